@@ -31,9 +31,7 @@
 #define PCIMAXFM_OFFSET_DATA		3
 #define PCIMAXFM_REGION_LENGTH		(PCIMAXFM_OFFSET_DATA + 1)
 
-#if PCIMAXFM_ENABLE_TX_TOGGLE
 #define PCIMAXFM_TX			(1 << 0)
-#endif /* PCIMAXFM_ENABLE_TX_TOGGLE */
 
 #define PCIMAXFM_MONO			(1 << 1)
 #define PCIMAXFM_I2C_SDA		(1 << 2)
@@ -43,7 +41,18 @@
 #define PCIMAXFM_I2C_ADDR_RDS		0x2c
 #define PCIMAXFM_I2C_ADDR_WRITE_FLAG	(1 << 7)
 
-#define PCIMAXFM_I2C_DELAY_USECS	100
+#define PCIMAXFM_I2C_DELAY_MAX_USECS	10000
+#define PCIMAXFM_I2C_DELAY_SLACK_USECS	10
+#define PCIMAXFM_I2C_SLEEP_MIN_USECS	10
+
+#define PCIMAXFM_I2C_RETRIES		2
+#define PCIMAXFM_I2C_RETRIES_MAX	10
+
+#define PCIMAXFM_I2C_CALIBRATE_PINGS	4
+#define PCIMAXFM_I2C_CALIBRATE_MARGIN	2
+
+#define PCIMAXFM_STATS_BUCKETS		24
+#define PCIMAXFM_STATS_IOCTLS		32
 
 #define PCIMAXFM_GET_MSB(value)		((value & 0xff00) >> 8)
 #define PCIMAXFM_GET_LSB(value)		(value & 0x00ff)
@@ -59,6 +68,33 @@
 
 #define PCIMAXFM_BOOL_NA		2
 
+#define PCIMAXFM_QUEUE_DEPTH		64
+#define PCIMAXFM_WRITE_MAX		8192
+#define PCIMAXFM_SEQ_MASK		0x7fffffff
+
+#define PCIMAXFM_RDS_VALUE_MAX		64
+#define PCIMAXFM_RDS_BATCH_MAX		128
+#define PCIMAXFM_RDS_PARAMS		81 /* RDS_PARAM_END */
+
+/* Cards one PCIMAXFM_BROADCAST2 can address, the largest --with-max-devs. */
+#define PCIMAXFM_BROADCAST_MAX		512
+
+#define PCIMAXFM_STATUS_VERSION		1
+#define PCIMAXFM_STATUS_TX		0x01
+#define PCIMAXFM_STATUS_RDS		0x02
+#define PCIMAXFM_STATUS_RDSSIGNAL	0x04
+
+#define PCIMAXFM_SHM_VERSION		1
+/* Offset of the RDS staging area for mmap(), page aligned. */
+#define PCIMAXFM_MMAP_STAGE		0x10000
+
+#define PCIMAXFM_FORMAT_TEXT		0
+#define PCIMAXFM_FORMAT_KEYVAL		1
+#define PCIMAXFM_FORMAT_JSON		2
+
+/* Longest RDS encoder frame: 0, parameter, 1, value, 2. */
+#define PCIMAXFM_RDS_FRAME_MAX		(1 + 4 + 1 + PCIMAXFM_RDS_VALUE_MAX + 1)
+
 #define PCIMAXFM_IOC_MAGIC	'+'
 
 #if PCIMAXFM_ENABLE_TX_TOGGLE
@@ -78,14 +114,150 @@
 #define PCIMAXFM_RDSSIGNAL_SET	_IOR(PCIMAXFM_IOC_MAGIC, 8, int)
 #define PCIMAXFM_RDSSIGNAL_GET	_IOW(PCIMAXFM_IOC_MAGIC, 9, int)
 #endif /* PCIMAXFM_ENABLE_RDS_TOGGLE */
+/* PCIMAXFM_RDS_SET, PCIMAXFM_RDS_SET_BATCH and PCIMAXFM_BROADCAST carry
+ * pointers, so 32-bit callers on a 64-bit kernel get ENOTTY from them and
+ * must use the version 2 ioctls. */
 #define PCIMAXFM_RDS_SET	_IOR(PCIMAXFM_IOC_MAGIC, 10, struct pcimaxfm_rds_set *)
+#define PCIMAXFM_RDS_SET_BATCH	_IOR(PCIMAXFM_IOC_MAGIC, 12, struct pcimaxfm_rds_batch *)
+#define PCIMAXFM_RDS_GET	_IOWR(PCIMAXFM_IOC_MAGIC, 13, struct pcimaxfm_rds_get)
+#define PCIMAXFM_RDS_SET2	_IOR(PCIMAXFM_IOC_MAGIC, 18, struct pcimaxfm_rds_set2)
+#define PCIMAXFM_RDS_SET_BATCH2	_IOR(PCIMAXFM_IOC_MAGIC, 19, struct pcimaxfm_rds_batch2)
+#define PCIMAXFM_RDS_COMMIT	_IO(PCIMAXFM_IOC_MAGIC, 22)
 
 struct pcimaxfm_rds_set {
 	int param;
 	char *value;
 };
+
+struct pcimaxfm_rds_batch {
+	int count;
+	struct pcimaxfm_rds_set *sets;
+};
+
+/* Last value set for param. An empty value has never been set, a dirty one
+ * may not have reached the encoder. */
+struct pcimaxfm_rds_get {
+	int param;
+	int dirty;
+	char value[PCIMAXFM_RDS_VALUE_MAX + 1];
+};
 #endif /* PCIMAXFM_ENABLE_RDS */
 
+#define PCIMAXFM_PING		_IOR(PCIMAXFM_IOC_MAGIC, 11, int)
+#define PCIMAXFM_FENCE		_IOR(PCIMAXFM_IOC_MAGIC, 14, int)
+#define PCIMAXFM_QUEUE_STATUS	_IOW(PCIMAXFM_IOC_MAGIC, 15, struct pcimaxfm_queue_status)
+/* Not for 32-bit callers on a 64-bit kernel, see PCIMAXFM_RDS_SET. */
+#define PCIMAXFM_BROADCAST	_IOR(PCIMAXFM_IOC_MAGIC, 16, struct pcimaxfm_broadcast *)
+#define PCIMAXFM_STATUS_GET	_IOWR(PCIMAXFM_IOC_MAGIC, 17, struct pcimaxfm_status)
+#define PCIMAXFM_BROADCAST2	_IOWR(PCIMAXFM_IOC_MAGIC, 20, struct pcimaxfm_broadcast2)
+#define PCIMAXFM_FORMAT_SET	_IOR(PCIMAXFM_IOC_MAGIC, 21, int)
+
+/* Version 2 of the RDS and broadcast ioctls carries everything inline, with
+ * explicit value lengths. The layout is the same for 32 and 64-bit callers,
+ * which may only use these versions on a 64-bit kernel. */
+struct pcimaxfm_rds_set2 {
+	int param;
+	int len;
+	char value[PCIMAXFM_RDS_VALUE_MAX];
+};
+
+struct pcimaxfm_rds_batch2 {
+	int count;
+	struct pcimaxfm_rds_set2 sets[PCIMAXFM_RDS_BATCH_MAX];
+};
+
+/* As struct pcimaxfm_broadcast, with cmd one of the _SET ioctls taking an int
+ * or PCIMAXFM_RDS_SET_BATCH2 taking rds. The arrays are sized by the fixed
+ * PCIMAXFM_BROADCAST_MAX rather than the configured PCIMAXFM_MAX_DEVS, so
+ * the size and with it the ioctl number don't depend on how the module was
+ * configured. */
+struct pcimaxfm_broadcast2 {
+	unsigned int cmd;
+	int data;
+	int count;
+	int devs[PCIMAXFM_BROADCAST_MAX];
+	int status[PCIMAXFM_BROADCAST_MAX];
+	struct pcimaxfm_rds_batch2 rds;
+};
+
+/* Set requests on a nonblocking file return their sequence number. All
+ * sequence numbers up to done_seq have completed. */
+struct pcimaxfm_queue_status {
+	int depth;
+	int seq;
+	int done_seq;
+	int client_seq;
+	int error;
+};
+
+/* Apply one setting to the cards numbered in devs. cmd is one of the _SET
+ * ioctls taking an int, given in data, or PCIMAXFM_RDS_SET_BATCH taking rds.
+ * The result for each card is stored in status. Cards other than the one
+ * opened need CAP_DAC_OVERRIDE. */
+struct pcimaxfm_broadcast {
+	unsigned int cmd;
+	int data;
+	struct pcimaxfm_rds_batch *rds;
+	int count;
+	int *devs;
+	int *status;
+};
+
+/* Card state in one consistent snapshot, apart from the queue fields. Set
+ * version to PCIMAXFM_STATUS_VERSION before the call. flags tells which of
+ * the optional features the card has, values it lacks read NA. Bit n of
+ * rds_dirty set means RDS parameter n may not have reached the encoder. */
+struct pcimaxfm_status {
+	int version;
+	int flags;
+	int freq;
+	int power;
+	int tx;
+	int stereo;
+	int rdssignal;
+	int io_ctrl;
+	int io_data;
+	int queue_depth;
+	int done_seq;
+	unsigned int rds_dirty[(PCIMAXFM_RDS_PARAMS + 31) / 32];
+	char rds[PCIMAXFM_RDS_PARAMS][PCIMAXFM_RDS_VALUE_MAX + 1];
+};
+
+/* Status page mapped read-only at offset 0 of the device, updated after
+ * every bus operation. seq is odd while an update is in progress: read it,
+ * copy what is needed and read it again, retrying unless both reads gave the
+ * same even value. Fields are as in struct pcimaxfm_status, the counters
+ * wrap. */
+struct pcimaxfm_shm {
+	unsigned int seq;
+	int version;
+	int flags;
+	int freq;
+	int power;
+	int tx;
+	int stereo;
+	int rdssignal;
+	int io_ctrl;
+	int io_data;
+	unsigned int xfers;
+	unsigned int bytes;
+	unsigned int nacks;
+	unsigned int retries;
+	unsigned int rds_dirty[(PCIMAXFM_RDS_PARAMS + 31) / 32];
+	char rds[PCIMAXFM_RDS_PARAMS][PCIMAXFM_RDS_VALUE_MAX + 1];
+};
+
+/* RDS staging area mapped at PCIMAXFM_MMAP_STAGE by writers. Store a
+ * terminated value for parameter n in rds[n] and set bit n of mask, then
+ * PCIMAXFM_RDS_COMMIT sends the marked values that differ from those on
+ * the encoder in one transaction and clears their marks. A bit past the
+ * last parameter or an invalid value fails the commit with EINVAL and
+ * leaves the marks set. */
+struct pcimaxfm_rds_stage {
+	unsigned int mask[(PCIMAXFM_RDS_PARAMS + 31) / 32];
+	char rds[PCIMAXFM_RDS_PARAMS][PCIMAXFM_RDS_VALUE_MAX + 1];
+};
+
 #define PCIMAXFM_STR_BOOL(val)	(val == 0 ? "Off" : (val == 1 ? "On" : "NA"))
 
 #endif /* _PCIMAXFM_H */
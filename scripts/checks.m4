@@ -26,9 +26,17 @@ dnl ---------------------------------------------------------------------------
 AC_DEFUN([PCIMAXFM_WITH_VERSION],
   [
     AC_ARG_WITH([version],
-      AS_HELP_STRING([--with-version=200X], [Device version 2004/2005/2006/2007 @<:@2007@:>@]),
+      AS_HELP_STRING([--with-version=200X], [Device version 2004/2005/2006/2007, or any to pick per card when loaded @<:@2007@:>@]),
       [
-        if test $withval = "2004" -o $withval = "2005"; then
+        detect=0
+        if test $withval = "any"; then
+          dev_ver="2007"
+          detect=1
+          tx=1
+          inv_stereo=1
+          rds=1
+          rds_signal=1
+        elif test $withval = "2004" -o $withval = "2005"; then
           dev_ver=$withval
           tx=1
           inv_stereo=1
@@ -49,12 +57,13 @@ AC_DEFUN([PCIMAXFM_WITH_VERSION],
         else
           AC_MSG_ERROR([
 *** Unsupported device version. Value of --with-version must be
-*** 2004, 2005, 2006 or 2007 (default).
+*** 2004, 2005, 2006, 2007 (default) or any.
           ])
         fi
       ],
       [
         dev_ver="2007"
+        detect=0
         tx=0
         inv_stereo=0
         rds=1
@@ -63,6 +72,7 @@ AC_DEFUN([PCIMAXFM_WITH_VERSION],
     )
 
     AC_DEFINE_UNQUOTED([PCIMAXFM_DEVICE_VERSION], ["$dev_ver"], [Device version.])
+    AC_DEFINE_UNQUOTED([PCIMAXFM_DETECT_VERSION], [$detect], [Pick the device version of each card when loaded.])
     AC_DEFINE_UNQUOTED([PCIMAXFM_ENABLE_TX_TOGGLE], [$tx], [Enable transmitter power toggle.])
     AC_DEFINE_UNQUOTED([PCIMAXFM_INVERT_STEREO], [$inv_stereo], [Invert stereo encoder state flag.])
     AC_DEFINE_UNQUOTED([PCIMAXFM_ENABLE_RDS], [$rds], [Enable RDS encoder.])
@@ -1,16 +1,3 @@
-dnl Check target architecture
-dnl ---------------------------------------------------------------------------
-
-AC_DEFUN([PCIMAXFM_CHECK_ARCH],
-  [
-    AC_MSG_CHECKING([target architecture])
-    ARCH=`uname -m`
-    AC_MSG_RESULT($ARCH)
-
-    AM_CONDITIONAL(IS_X86_64, [test "$ARCH" = "x86_64"])
-  ]
-)
-
 dnl Set Linux kernel headers path.
 dnl ---------------------------------------------------------------------------
 
@@ -53,19 +40,22 @@ dnl ---------------------------------------------------------------------------
 
 AC_DEFUN([PCIMAXFM_CHECK_LINUX_VERSION],
   [
-    AC_MSG_CHECKING([for Linux kernel version >= 2.6.36])
+    dnl PCI reset hooks need 4.13. From 6.3 on vm_flags is read-only, and
+    dnl class_create() and strlcpy() change or go away soon after.
+    AC_MSG_CHECKING([for Linux kernel version >= 4.13 and < 6.3])
 
     AC_COMPILE_IFELSE([
       AC_LANG_SOURCE(
         [[#include "]]$KERNEL_DIR[[/include/generated/uapi/linux/version.h"
-          #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,36)
+          #if LINUX_VERSION_CODE < KERNEL_VERSION(4,13,0) || \
+              LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0)
           #error "Unsupported version"
           #endif
         ]]
       )],
       AC_MSG_RESULT([yes]),
       AC_MSG_ERROR([
-*** Linux kernel version >= 2.6.36 required.
+*** Linux kernel version >= 4.13 and < 6.3 required.
       ])
     )
   ]
@@ -0,0 +1,411 @@
+/*
+ * pcimaxfm - PCI MAX FM transmitter driver and tools
+ * Copyright (C) 2007-2013 Daniel Stien <daniel@stien.org>
+ *  
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software 
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <pcimaxfm.h>
+
+#include "i2c.h"
+
+/* Slots hold the line levels, the operation and the timing phase waited
+ * after it. */
+#define SLOT_SDA		0x01
+#define SLOT_SCL		0x02
+#define SLOT_OP(slot)		((slot) & 0x0c)
+#define SLOT_SET		0x00
+#define SLOT_WAIT		0x04
+#define SLOT_ACK		0x08
+#define SLOT_PHASE(slot)	((slot) >> 4)
+
+enum
+{
+	PHASE_NONE, PHASE_SETUP, PHASE_HIGH, PHASE_TAIL, PHASE_LOW, PHASE_END
+};
+
+/* Time between the falling SCL edge and the next SDA change, stretched so
+ * that hold plus setup time covers the SCL low period. */
+static unsigned int i2c_tail(const struct pcimaxfm_i2c_timing *t)
+{
+	if (t->low > t->setup + t->hold)
+		return t->low - t->setup;
+
+	return t->hold;
+}
+
+static void i2c_phases(const struct pcimaxfm_i2c_timing *t,
+		unsigned int *usecs)
+{
+	usecs[PHASE_NONE]  = 0;
+	usecs[PHASE_SETUP] = t->setup;
+	usecs[PHASE_HIGH]  = t->high;
+	usecs[PHASE_TAIL]  = i2c_tail(t);
+	usecs[PHASE_LOW]   = t->low;
+}
+
+static void i2c_emit(struct pcimaxfm_i2c_wave *wave, unsigned char slot)
+{
+	if (wave->count < PCIMAXFM_I2C_WAVE_SLOTS)
+		wave->slots[wave->count++] = slot;
+}
+
+static void i2c_event(struct pcimaxfm_i2c *bus, int event, unsigned int value)
+{
+	if (!bus->wave)
+		pcimaxfm_i2c_port_event(bus->port, event, value);
+}
+
+/* Drive the lines, skipping writes that would not change them. */
+static inline void i2c_lines(struct pcimaxfm_i2c *bus, int sda, int scl)
+{
+	if (sda == bus->sda && scl == bus->scl)
+		return;
+
+	bus->sda = sda;
+	bus->scl = scl;
+
+	if (bus->wave) {
+		i2c_emit(bus->wave, SLOT_SET | (sda ? SLOT_SDA : 0) |
+				(scl ? SLOT_SCL : 0));
+	} else
+		pcimaxfm_i2c_port_set(bus->port, sda, scl);
+}
+
+static inline void i2c_sda(struct pcimaxfm_i2c *bus, int level)
+{
+	i2c_lines(bus, level, bus->scl);
+}
+
+static inline void i2c_scl(struct pcimaxfm_i2c *bus, int level)
+{
+	i2c_lines(bus, bus->sda, level);
+}
+
+static inline void i2c_delay(struct pcimaxfm_i2c *bus, int phase)
+{
+	struct pcimaxfm_i2c_wave *wave = bus->wave;
+
+	if (wave) {
+		/* Hang the wait on the last slot unless it has one. */
+		if (wave->count &&
+				SLOT_PHASE(wave->slots[wave->count - 1]) == PHASE_NONE)
+			wave->slots[wave->count - 1] |= phase << 4;
+		else
+			i2c_emit(wave, SLOT_WAIT | phase << 4);
+
+		return;
+	}
+
+	switch (phase) {
+		case PHASE_SETUP:
+			pcimaxfm_i2c_port_delay(bus->port, bus->timing.setup);
+			break;
+		case PHASE_HIGH:
+			pcimaxfm_i2c_port_delay(bus->port, bus->timing.high);
+			break;
+		case PHASE_TAIL:
+			pcimaxfm_i2c_port_delay(bus->port,
+					i2c_tail(&bus->timing));
+			break;
+		case PHASE_LOW:
+			pcimaxfm_i2c_port_delay(bus->port, bus->timing.low);
+			break;
+	}
+}
+
+static void i2c_clock(struct pcimaxfm_i2c *bus)
+{
+	i2c_delay(bus, PHASE_SETUP);
+	i2c_scl(bus, 1);
+	i2c_delay(bus, PHASE_HIGH);
+	i2c_scl(bus, 0);
+	i2c_delay(bus, PHASE_TAIL);
+}
+
+/* Returns non-zero if the target did not acknowledge the byte. Compiled
+ * bytes are taken as acknowledged, the sample is left to the replay. */
+static int i2c_write_byte(struct pcimaxfm_i2c *bus, unsigned char value)
+{
+	int i, nack = 0;
+
+	for (i = 0; i < 8; i++) {
+		i2c_sda(bus, (value >> (7 - i)) & 1);
+		i2c_clock(bus);
+	}
+
+	i2c_sda(bus, 1);
+	i2c_delay(bus, PHASE_SETUP);
+	i2c_scl(bus, 1);
+	i2c_delay(bus, PHASE_HIGH);
+
+	if (bus->wave)
+		i2c_emit(bus->wave, SLOT_ACK);
+	else
+		nack = pcimaxfm_i2c_port_get_sda(bus->port);
+
+	i2c_scl(bus, 0);
+	i2c_delay(bus, PHASE_TAIL);
+
+	i2c_event(bus, PCIMAXFM_I2C_EVENT_BYTE, value | (nack ? 1 << 8 : 0));
+
+	return nack;
+}
+
+static int i2c_start(struct pcimaxfm_i2c *bus, unsigned char addr)
+{
+	i2c_event(bus, PCIMAXFM_I2C_EVENT_START, addr);
+
+	i2c_delay(bus, PHASE_LOW);
+	i2c_sda(bus, 1);
+	i2c_scl(bus, 1);
+	i2c_delay(bus, PHASE_HIGH);
+	i2c_sda(bus, 0);
+	i2c_delay(bus, PHASE_HIGH);
+	i2c_scl(bus, 0);
+	i2c_delay(bus, PHASE_TAIL);
+
+	return i2c_write_byte(bus, addr) ?
+		PCIMAXFM_I2C_NACK_ADDR : PCIMAXFM_I2C_ACK;
+}
+
+static void i2c_stop(struct pcimaxfm_i2c *bus)
+{
+	i2c_sda(bus, 0);
+	i2c_delay(bus, PHASE_SETUP);
+	i2c_scl(bus, 1);
+	i2c_delay(bus, PHASE_HIGH);
+	i2c_sda(bus, 1);
+
+	i2c_event(bus, PCIMAXFM_I2C_EVENT_STOP, 0);
+}
+
+/* Address-only transaction, returns PCIMAXFM_I2C_ACK if the target
+ * responded. */
+int pcimaxfm_i2c_ping(struct pcimaxfm_i2c *bus, unsigned char addr)
+{
+	int ret;
+
+	ret = i2c_start(bus, addr | PCIMAXFM_I2C_ADDR_WRITE_FLAG);
+	i2c_stop(bus);
+
+	return ret;
+}
+
+/* Write a transaction, giving up on the first unacknowledged byte and
+ * retrying from the start condition up to bus->retries times. The port may
+ * end it early between data bytes, see pcimaxfm_i2c_port_yield(). */
+int pcimaxfm_i2c_write(struct pcimaxfm_i2c *bus, unsigned char addr,
+		const unsigned char *buf, int len)
+{
+	int i, ret;
+
+	bus->attempts = 0;
+	bus->sent = 0;
+
+	do {
+		ret = i2c_start(bus, addr | PCIMAXFM_I2C_ADDR_WRITE_FLAG);
+
+		for (i = 0; ret == PCIMAXFM_I2C_ACK && i < len; i++) {
+			if (i2c_write_byte(bus, buf[i]))
+				ret = PCIMAXFM_I2C_NACK_DATA;
+			else if (i + 1 < len &&
+					pcimaxfm_i2c_port_yield(bus->port))
+				ret = PCIMAXFM_I2C_YIELD;
+		}
+
+		i2c_stop(bus);
+
+		bus->attempts++;
+		bus->sent += i;
+		bus->acked = ret == PCIMAXFM_I2C_NACK_DATA ? i - 1 : i;
+	} while (ret != PCIMAXFM_I2C_ACK && ret != PCIMAXFM_I2C_YIELD &&
+			bus->attempts <= bus->retries);
+
+	return ret;
+}
+
+/* Free the bus after a transaction was cut short: clock out whatever the
+ * target still has to say with SDA released, at most a byte and its
+ * acknowledge, then STOP. Returns non-zero if SDA is still held low. */
+int pcimaxfm_i2c_recover(struct pcimaxfm_i2c *bus)
+{
+	int i;
+
+	i2c_scl(bus, 0);
+	i2c_delay(bus, PHASE_TAIL);
+	i2c_sda(bus, 1);
+
+	for (i = 0; i < 9; i++) {
+		i2c_clock(bus);
+
+		if (pcimaxfm_i2c_port_get_sda(bus->port))
+			break;
+	}
+
+	i2c_stop(bus);
+
+	return !pcimaxfm_i2c_port_get_sda(bus->port);
+}
+
+/* Compile a write transaction into wave, for replay by pcimaxfm_i2c_run().
+ * Returns -1 if the payload exceeds PCIMAXFM_I2C_WAVE_DATA_MAX bytes. */
+int pcimaxfm_i2c_compile(struct pcimaxfm_i2c_wave *wave, unsigned char addr,
+		const unsigned char *buf, int len)
+{
+	struct pcimaxfm_i2c bus = { .sda = 1, .scl = 1, .wave = wave };
+	int i;
+
+	if (len > PCIMAXFM_I2C_WAVE_DATA_MAX)
+		return -1;
+
+	wave->len = len;
+	wave->count = 0;
+	wave->bytes[0] = addr | PCIMAXFM_I2C_ADDR_WRITE_FLAG;
+	for (i = 0; i < len; i++)
+		wave->bytes[1 + i] = buf[i];
+
+	i2c_start(&bus, wave->bytes[0]);
+	for (i = 0; i < len; i++)
+		i2c_write_byte(&bus, buf[i]);
+	i2c_stop(&bus);
+
+	return 0;
+}
+
+/* Play a wave once. Waits between port accesses are summed into one, and a
+ * NACK cuts the wave short with a STOP. */
+static int i2c_replay(struct pcimaxfm_i2c *bus,
+		const struct pcimaxfm_i2c_wave *wave)
+{
+	unsigned int i, byte = 0, wait = 0, usecs[PHASE_END];
+	unsigned char slot;
+	int nack;
+
+	i2c_phases(&bus->timing, usecs);
+
+	/* Waves start from an idle bus. */
+	i2c_sda(bus, 1);
+	i2c_scl(bus, 1);
+
+	i2c_event(bus, PCIMAXFM_I2C_EVENT_START, wave->bytes[0]);
+
+	for (i = 0; i < wave->count; i++) {
+		slot = wave->slots[i];
+
+		if (SLOT_OP(slot) != SLOT_WAIT && wait) {
+			pcimaxfm_i2c_port_delay(bus->port, wait);
+			wait = 0;
+		}
+
+		if (SLOT_OP(slot) == SLOT_SET) {
+			bus->sda = (slot & SLOT_SDA) != 0;
+			bus->scl = (slot & SLOT_SCL) != 0;
+			pcimaxfm_i2c_port_set(bus->port, bus->sda, bus->scl);
+		} else if (SLOT_OP(slot) == SLOT_ACK) {
+			nack = pcimaxfm_i2c_port_get_sda(bus->port);
+
+			i2c_event(bus, PCIMAXFM_I2C_EVENT_BYTE,
+					wave->bytes[byte] | (nack ? 1 << 8 : 0));
+
+			if (byte)
+				bus->sent++;
+
+			if (nack) {
+				i2c_scl(bus, 0);
+				i2c_delay(bus, PHASE_TAIL);
+				i2c_stop(bus);
+
+				return byte ? PCIMAXFM_I2C_NACK_DATA :
+					PCIMAXFM_I2C_NACK_ADDR;
+			}
+
+			byte++;
+		}
+
+		wait += usecs[SLOT_PHASE(slot)];
+	}
+
+	if (wait)
+		pcimaxfm_i2c_port_delay(bus->port, wait);
+
+	i2c_event(bus, PCIMAXFM_I2C_EVENT_STOP, 0);
+
+	return PCIMAXFM_I2C_ACK;
+}
+
+/* Replay a compiled write with the retries of pcimaxfm_i2c_write(). */
+int pcimaxfm_i2c_run(struct pcimaxfm_i2c *bus,
+		const struct pcimaxfm_i2c_wave *wave)
+{
+	int ret;
+
+	bus->attempts = 0;
+	bus->sent = 0;
+
+	do {
+		ret = i2c_replay(bus, wave);
+		bus->attempts++;
+	} while (ret != PCIMAXFM_I2C_ACK && bus->attempts <= bus->retries);
+
+	return ret;
+}
+
+/* Clamp freq and power to the PLL limits and encode them into buf, which must
+ * hold 4 bytes. Returns the frame length. */
+int pcimaxfm_pll_frame(unsigned char *buf, int *freq, int *power)
+{
+	if (*freq == PCIMAXFM_FREQ_NA)
+		*freq = PCIMAXFM_FREQ_DEFAULT;
+	else if (*freq < PCIMAXFM_FREQ_MIN)
+		*freq = PCIMAXFM_FREQ_MIN;
+	else if (*freq > PCIMAXFM_FREQ_MAX)
+		*freq = PCIMAXFM_FREQ_MAX;
+
+	if (*power == PCIMAXFM_POWER_NA)
+		*power = PCIMAXFM_POWER_MIN;
+	else if (*power < PCIMAXFM_POWER_MIN)
+		*power = PCIMAXFM_POWER_MIN;
+	else if (*power > PCIMAXFM_POWER_MAX)
+		*power = PCIMAXFM_POWER_MAX;
+
+	buf[0] = PCIMAXFM_GET_MSB(*freq);
+	buf[1] = PCIMAXFM_GET_LSB(*freq);
+	buf[2] = 192;
+	buf[3] = *power;
+
+	return 4;
+}
+
+/* Encode a parameter assignment for the RDS encoder into buf, which must hold
+ * PCIMAXFM_RDS_FRAME_MAX bytes. Returns the frame length. */
+int pcimaxfm_rds_frame(unsigned char *buf, const char *parameter,
+		const char *value)
+{
+	int len = 0;
+	const char *c;
+
+	buf[len++] = 0;
+	for (c = parameter; *c && len < PCIMAXFM_RDS_FRAME_MAX - 2; c++)
+		buf[len++] = *c;
+
+	buf[len++] = 1;
+	for (c = value; *c && len < PCIMAXFM_RDS_FRAME_MAX - 1; c++)
+		buf[len++] = *c;
+
+	buf[len++] = 2;
+
+	return len;
+}
@@ -0,0 +1,103 @@
+/*
+ * pcimaxfm - PCI MAX FM transmitter driver and tools
+ * Copyright (C) 2007-2013 Daniel Stien <daniel@stien.org>
+ *  
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software 
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _PCIMAXFM_COMMON_I2C_H
+#define _PCIMAXFM_COMMON_I2C_H
+
+/* Per-phase bus timing in microseconds. */
+struct pcimaxfm_i2c_timing {
+	unsigned int setup;
+	unsigned int hold;
+	unsigned int high;
+	unsigned int low;
+};
+
+/* Largest payload of a compiled transaction, and the slots it may take: a
+ * byte is at most 28 slots with its acknowledge, START and STOP fewer than
+ * 16 together. */
+#define PCIMAXFM_I2C_WAVE_DATA_MAX	16
+#define PCIMAXFM_I2C_WAVE_SLOTS		(16 + 28 * (1 + PCIMAXFM_I2C_WAVE_DATA_MAX))
+
+/* Transaction compiled into one slot per line change, wait or acknowledge
+ * sample, starting and ending on an idle bus. Slots refer to timing phases
+ * rather than durations, so a wave outlives changes to the bus timing. */
+struct pcimaxfm_i2c_wave {
+	unsigned int len;
+	unsigned int count;
+	unsigned char bytes[1 + PCIMAXFM_I2C_WAVE_DATA_MAX];
+	unsigned char slots[PCIMAXFM_I2C_WAVE_SLOTS];
+};
+
+/* Bit-banged bus. The sequencer keeps the line levels, the port hooks only
+ * put them on the wire, and only when a level changes. */
+struct pcimaxfm_i2c {
+	void *port;
+	struct pcimaxfm_i2c_timing timing;
+	unsigned int retries;
+	int sda;
+	int scl;
+
+	/* Set while compiling into it instead of driving the port. */
+	struct pcimaxfm_i2c_wave *wave;
+
+	/* Outcome of the last pcimaxfm_i2c_write() or pcimaxfm_i2c_run(). */
+	unsigned int attempts;
+	unsigned int sent;
+
+	/* Payload bytes acknowledged by the last attempt of a write. */
+	unsigned int acked;
+};
+
+enum
+{
+	PCIMAXFM_I2C_ACK, PCIMAXFM_I2C_NACK_ADDR, PCIMAXFM_I2C_NACK_DATA,
+	PCIMAXFM_I2C_YIELD
+};
+
+enum
+{
+	PCIMAXFM_I2C_EVENT_START, PCIMAXFM_I2C_EVENT_BYTE, PCIMAXFM_I2C_EVENT_STOP
+};
+
+/* Port hooks, resolved at link time. The driver implements them on the card
+ * ports, the simulator on a recorded waveform. */
+void pcimaxfm_i2c_port_set(void *port, int sda, int scl);
+int pcimaxfm_i2c_port_get_sda(void *port);
+void pcimaxfm_i2c_port_delay(void *port, unsigned int usecs);
+
+/* START carries the address, BYTE the value with the NACK in bit 8. */
+void pcimaxfm_i2c_port_event(void *port, int event, unsigned int value);
+
+/* Asked after each acknowledged data byte of a write but the last. Non-zero
+ * ends the transaction there with a STOP, and the write returns
+ * PCIMAXFM_I2C_YIELD without retrying. */
+int pcimaxfm_i2c_port_yield(void *port);
+
+int pcimaxfm_i2c_ping(struct pcimaxfm_i2c *, unsigned char);
+int pcimaxfm_i2c_write(struct pcimaxfm_i2c *, unsigned char,
+		const unsigned char *, int);
+int pcimaxfm_i2c_recover(struct pcimaxfm_i2c *);
+int pcimaxfm_i2c_compile(struct pcimaxfm_i2c_wave *, unsigned char,
+		const unsigned char *, int);
+int pcimaxfm_i2c_run(struct pcimaxfm_i2c *, const struct pcimaxfm_i2c_wave *);
+
+int pcimaxfm_pll_frame(unsigned char *, int *, int *);
+int pcimaxfm_rds_frame(unsigned char *, const char *, const char *);
+
+#endif /* _PCIMAXFM_COMMON_I2C_H */
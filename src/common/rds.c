@@ -92,6 +92,18 @@ int snprintf(char *, size_t, const char *, ...);
 size_t strlen(const char *);
 int sscanf(const char *, const char *, ...);
 
+/* Line breaks would forge lines in KEY=VALUE output and bytes 0, 1 and 2
+ * delimit encoder frames, so text is limited to characters from space up. */
+static int text_printable(const char *val)
+{
+	for (; *val; val++) {
+		if ((unsigned char)*val < ' ')
+			return 0;
+	}
+
+	return 1;
+}
+
 int validate_rds(int param, char *val, int err_len, char *err)
 {
 	int len, integer;
@@ -110,7 +122,7 @@ int validate_rds(int param, char *val, int err_len, char *err)
 		case TEXT8:
 			len = strlen(val);
 
-			if (len < 1 || len > 8) {
+			if (len < 1 || len > 8 || !text_printable(val)) {
 				RDS_MSG_ERR("Invalid value for RDS parameter %s. Got \"%s\", expected 1-8 characters text string.", rds_params_name[param], val);
 			}
 			break;
@@ -118,7 +130,7 @@ int validate_rds(int param, char *val, int err_len, char *err)
 		case TEXT64:
 			len = strlen(val);
 
-			if (len < 1 || len > 64) {
+			if (len < 1 || len > 64 || !text_printable(val)) {
 				RDS_MSG_ERR("Invalid value for RDS parameter %s. Got \"%s\", expected 1-64 characters text string.", rds_params_name[param], val);
 			}
 			break;
@@ -20,21 +20,47 @@
 #include <pcimaxfm.h>
 
 #include <asm/uaccess.h>
+#include <linux/bitops.h>
 #include <linux/cdev.h>
+#include <linux/compat.h>
+#include <linux/debugfs.h>
 #include <linux/delay.h>
 #include <linux/device.h>
 #include <linux/errno.h>
+#include <linux/firmware.h>
 #include <linux/fs.h>
+#include <linux/idr.h>
 #include <linux/init.h>
 #include <linux/kernel.h>
+#include <linux/kref.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/log2.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
 #include <linux/pci.h>
+#include <linux/poll.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/seqlock.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
 #include <linux/types.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+
+#include "../../common/i2c.h"
 
 #if PCIMAXFM_ENABLE_RDS
 #include "../../common/rds.h"
 #endif /* PCIMAXFM_ENABLE_RDS */
 
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
 #define KMSG(lvl, fmt, ...) \
 	printk(lvl PACKAGE ": " fmt "\n", ## __VA_ARGS__)
 #define KMSGN(lvl, fmt, ...) \
@@ -44,8 +70,12 @@
 #define KMSG_ERRN(fmt, ...)   KMSGN(KERN_ERR, fmt, ## __VA_ARGS__)
 #define KMSG_INFO(fmt, ...)   KMSG(KERN_INFO, fmt, ## __VA_ARGS__)
 #define KMSG_INFON(fmt, ...)  KMSGN(KERN_INFO, fmt, ## __VA_ARGS__)
-#define KMSG_DEBUG(fmt, ...)  KMSG(KERN_DEBUG, fmt, ## __VA_ARGS__)
-#define KMSG_DEBUGN(fmt, ...) KMSGN(KERN_DEBUG, fmt, ## __VA_ARGS__)
+
+/* Debug messages go through dynamic debug and cost nothing unless enabled. */
+#define KMSG_DEBUG(fmt, ...) \
+	pr_debug(PACKAGE ": " fmt "\n", ## __VA_ARGS__)
+#define KMSG_DEBUGN(fmt, ...) \
+	pr_debug(PACKAGE "%u: " fmt "\n", dev->dev_num, ## __VA_ARGS__)
 
 MODULE_LICENSE("GPL");
 MODULE_VERSION(PACKAGE_VERSION);
@@ -54,460 +84,3485 @@ MODULE_DESCRIPTION(PACKAGE_DESCRIPTION);
 
 static int pcimaxfm_major = PCIMAXFM_MAJOR;
 static struct class *pcimaxfm_class;
+static struct dentry *pcimaxfm_debugfs;
+
+/* Minor number to device, for open(). */
+static DEFINE_IDR(pcimaxfm_idr);
+static DEFINE_MUTEX(pcimaxfm_idr_lock);
+
+enum pcimaxfm_i2c_profile {
+	PCIMAXFM_I2C_CONSERVATIVE,
+	PCIMAXFM_I2C_STANDARD,
+	PCIMAXFM_I2C_FAST,
+	PCIMAXFM_I2C_CUSTOM,
+	PCIMAXFM_I2C_PROFILE_END
+};
+
+/* Features that differ between card generations. */
+#define PCIMAXFM_CAP_TX		PCIMAXFM_STATUS_TX
+#define PCIMAXFM_CAP_RDS	PCIMAXFM_STATUS_RDS
+#define PCIMAXFM_CAP_RDSSIGNAL	PCIMAXFM_STATUS_RDSSIGNAL
+#define PCIMAXFM_CAP_INV_STEREO	0x100
+
+/* Features this build can drive at all. */
+#define PCIMAXFM_CAPS ( \
+	(PCIMAXFM_ENABLE_TX_TOGGLE  ? PCIMAXFM_CAP_TX         : 0) | \
+	(PCIMAXFM_ENABLE_RDS        ? PCIMAXFM_CAP_RDS        : 0) | \
+	(PCIMAXFM_ENABLE_RDS_TOGGLE ? PCIMAXFM_CAP_RDSSIGNAL  : 0) | \
+	(PCIMAXFM_INVERT_STEREO     ? PCIMAXFM_CAP_INV_STEREO : 0))
+
+struct pcimaxfm_card {
+	const char *version;
+	unsigned int caps;
+};
+
+static const struct pcimaxfm_card pcimaxfm_cards[] = {
+	{ "2004", PCIMAXFM_CAP_TX | PCIMAXFM_CAP_INV_STEREO },
+	{ "2005", PCIMAXFM_CAP_TX | PCIMAXFM_CAP_INV_STEREO },
+	{ "2006", PCIMAXFM_CAP_RDS | PCIMAXFM_CAP_INV_STEREO },
+	{ "2007", PCIMAXFM_CAP_RDS | PCIMAXFM_CAP_RDSSIGNAL }
+};
+
+#if PCIMAXFM_ENABLE_RDS
+/* Parameter assignment copied into the kernel. */
+struct pcimaxfm_rds_value {
+	int param;
+	char value[PCIMAXFM_RDS_VALUE_MAX + 1];
+};
+#endif /* PCIMAXFM_ENABLE_RDS */
+
+/* Settings as last published by the bus owner. Readers take a snapshot under
+ * state_seq instead of waiting for transfers to finish. */
+struct pcimaxfm_state {
+	unsigned int freq;
+	unsigned int power;
+#if PCIMAXFM_ENABLE_RDS_TOGGLE
+	unsigned int rdssignal;
+#endif /* PCIMAXFM_ENABLE_RDS_TOGGLE */
+	u8 io_ctrl;
+	u8 io_data;
+};
+
+enum pcimaxfm_stats_target {
+	PCIMAXFM_STATS_PLL,
+	PCIMAXFM_STATS_RDS,
+	PCIMAXFM_STATS_TARGETS
+};
+
+/* Counters for debugfs. Latencies are log2 histograms in microseconds,
+ * bucket n counting durations below 2^n. */
+struct pcimaxfm_stats {
+	atomic_long_t xfers[PCIMAXFM_STATS_TARGETS];
+	atomic_long_t bytes[PCIMAXFM_STATS_TARGETS];
+	atomic_long_t nacks;
+	atomic_long_t retries;
+	atomic_long_t spin_us;
+	atomic_long_t bus_us;
+	atomic_long_t ioctls[PCIMAXFM_STATS_IOCTLS];
+	atomic_long_t freq_power_us[PCIMAXFM_STATS_BUCKETS];
+	atomic_long_t rds_us[PCIMAXFM_STATS_BUCKETS];
+};
+
+/* Classes of requests, served in this order: tuning and power, then the
+ * toggles, then RDS text. */
+enum pcimaxfm_lane {
+	PCIMAXFM_LANE_TUNE,
+	PCIMAXFM_LANE_TOGGLE,
+	PCIMAXFM_LANE_RDS,
+	PCIMAXFM_LANES
+};
 
 struct pcimaxfm_dev {
 	unsigned int dev_num;
 	unsigned long base_addr;
 
+	/* Held by the PCI binding and by each open file. */
+	struct kref ref;
+
+	/* Generation of the card and the features of it this build drives. */
+	const struct pcimaxfm_card *card;
+	unsigned int caps;
+
 	u8 io_ctrl;
 	u8 io_data;
 
+	int i2c_profile;
+	struct pcimaxfm_i2c i2c;
+	ktime_t i2c_start;
+	/* RDS frames closed and acknowledged since the last START. */
+	unsigned int i2c_frames;
+
 	unsigned int freq;
 	unsigned int power;
 #if PCIMAXFM_ENABLE_RDS_TOGGLE
 	unsigned int rdssignal;
 #endif
+#if PCIMAXFM_ENABLE_RDS
+	/* Last value requested for each RDS parameter. Dirty parameters
+	 * are not known to hold that value on the encoder. */
+	char rds[RDS_PARAM_END][PCIMAXFM_RDS_VALUE_MAX + 1];
+	DECLARE_BITMAP(rds_dirty, RDS_PARAM_END);
+#endif /* PCIMAXFM_ENABLE_RDS */
+#if PCIMAXFM_ENABLE_RDS_TOGGLE
+	/* PWR=0 and PWR=1, compiled once. */
+	struct pcimaxfm_i2c_wave rds_pwr[2];
+#endif /* PCIMAXFM_ENABLE_RDS_TOGGLE */
+
+	/* Held for every access to the ports and for changes to the bus
+	 * timing. Also serialises writers of state_seq. */
+	struct mutex bus_lock;
+	seqcount_t state_seq;
+	struct pcimaxfm_state state;
+	/* Mapped by readers, updated along with state. */
+	struct pcimaxfm_shm *shm;
+#if PCIMAXFM_ENABLE_RDS
+	/* Mapped by writers, taken in by PCIMAXFM_RDS_COMMIT. */
+	struct pcimaxfm_rds_stage *rds_stage;
+#endif /* PCIMAXFM_ENABLE_RDS */
+	/* Set under bus_lock when the card lost its settings, cleared by the
+	 * work item once they are replayed. */
+	int restore;
+	/* Set under bus_lock while the request on the bus may give it up. */
+	int yield;
 
+	/* Writable opens, exclusive unless privileged. */
 	unsigned int use_count;
 	spinlock_t use_lock;
 	struct pci_dev *pci_dev;
-	struct cdev cdev;
+	struct cdev *cdev;
+
+	/* Bus operations are queued and carried out by the work item, one
+	 * at a time. The first non-empty lane is served first, and within a
+	 * lane each opener gets its share of the bytes on the bus: a request
+	 * starts at the lane's virtual time or where the opener's previous
+	 * one ended, whichever is later, and the earliest start goes next.
+	 * Requests from the driver itself share one budget. */
+	spinlock_t queue_lock;
+	struct list_head lanes[PCIMAXFM_LANES];
+	u64 lane_vtime[PCIMAXFM_LANES];
+	u64 vfinish[PCIMAXFM_LANES];
+	unsigned int queue_len;
+	unsigned int seq;
+	unsigned int done_seq;
+	struct pcimaxfm_request *active;
+	/* Set when a request is queued in a lane ahead of the active one. */
+	int preempt;
+	wait_queue_head_t queue_wait;
+	struct work_struct work;
+	/* Private worker, bound to cpu unless that is negative. Nothing is
+	 * queued once the card is gone. */
+	struct workqueue_struct *wq;
+	int cpu;
+	int gone;
+
+	struct pcimaxfm_stats stats;
+	struct dentry *debugfs;
+};
+
+enum pcimaxfm_request_type {
+	PCIMAXFM_REQ_TX,
+	PCIMAXFM_REQ_FREQ,
+	PCIMAXFM_REQ_POWER,
+	PCIMAXFM_REQ_STEREO,
+	PCIMAXFM_REQ_RDSSIGNAL,
+	PCIMAXFM_REQ_RDS,
+	PCIMAXFM_REQ_PING,
+	PCIMAXFM_REQ_CALIBRATE
 };
 
-static struct pcimaxfm_dev pcimaxfm_devs[PCIMAXFM_MAX_DEVS];
+/* Queued bus operation. A request with a waiter is freed by the submitter
+ * once done, others by the work item. */
+struct pcimaxfm_request {
+	struct list_head list;
+	struct pcimaxfm_client *client;
+	unsigned int seq;
+	int lane;
+	u64 vstart;
+	int type;
+	int data;
+	int result;
+	int waiter;
+	int done;
+	/* Set when the waiter gave up on it while on the bus. */
+	int cancel;
+	/* Set once it gave the bus up and was queued again. */
+	int resumed;
+#if PCIMAXFM_ENABLE_RDS
+	int count;
+	struct pcimaxfm_rds_value rds[0];
+#endif /* PCIMAXFM_ENABLE_RDS */
+};
 
-static unsigned int pcimaxfm_num_devs = 0;
+/* Per-open state, kept as the private data of the file's seq_file. */
+struct pcimaxfm_client {
+	struct pcimaxfm_dev *dev;
+	unsigned int seq;
+	int error;
+	int format;
+	u64 vfinish[PCIMAXFM_LANES];
+};
 
-static void pcimaxfm_i2c_sda_set(struct pcimaxfm_dev *dev)
+static inline struct pcimaxfm_client *pcimaxfm_client(struct file *filp)
 {
-	dev->io_data |= PCIMAXFM_I2C_SDA;
-	outb(dev->io_data, dev->base_addr + PCIMAXFM_OFFSET_DATA);
+	return ((struct seq_file *)filp->private_data)->private;
 }
 
-static void pcimaxfm_i2c_sda_clr(struct pcimaxfm_dev *dev)
+/* Whether the card has all of caps. A build for a single card version knows
+ * the answer at compile time, so there the tests fold away. */
+static inline int pcimaxfm_has(const struct pcimaxfm_dev *dev,
+		unsigned int caps)
 {
-	dev->io_data &= ~PCIMAXFM_I2C_SDA;
-	outb(dev->io_data, dev->base_addr + PCIMAXFM_OFFSET_DATA);
+#if PCIMAXFM_DETECT_VERSION
+	return (dev->caps & caps) == caps;
+#else
+	return (PCIMAXFM_CAPS & caps) == caps;
+#endif /* PCIMAXFM_DETECT_VERSION */
 }
 
-static void pcimaxfm_i2c_scl_set(struct pcimaxfm_dev *dev)
+static char *i2c_profile = "conservative";
+module_param(i2c_profile, charp, 0444);
+MODULE_PARM_DESC(i2c_profile, "I2C timing profile: conservative, standard, "
+		"fast or custom (default: conservative)");
+
+static unsigned int i2c_setup_us = 100;
+module_param(i2c_setup_us, uint, 0444);
+MODULE_PARM_DESC(i2c_setup_us, "Custom profile SDA setup time in usecs");
+
+static unsigned int i2c_hold_us = 100;
+module_param(i2c_hold_us, uint, 0444);
+MODULE_PARM_DESC(i2c_hold_us, "Custom profile SDA hold time in usecs");
+
+static unsigned int i2c_high_us = 100;
+module_param(i2c_high_us, uint, 0444);
+MODULE_PARM_DESC(i2c_high_us, "Custom profile SCL high time in usecs");
+
+static unsigned int i2c_low_us = 200;
+module_param(i2c_low_us, uint, 0444);
+MODULE_PARM_DESC(i2c_low_us, "Custom profile SCL low time in usecs");
+
+static unsigned int i2c_retries = PCIMAXFM_I2C_RETRIES;
+module_param(i2c_retries, uint, 0444);
+MODULE_PARM_DESC(i2c_retries, "Times to retry an unacknowledged I2C "
+		"transaction (default: " __stringify(PCIMAXFM_I2C_RETRIES) ")");
+
+static bool i2c_calibrate = 0;
+module_param(i2c_calibrate, bool, 0444);
+MODULE_PARM_DESC(i2c_calibrate, "Calibrate I2C timing when a card is found");
+
+static char *worker_cpu[PCIMAXFM_MAX_DEVS];
+static int worker_cpu_num = 0;
+module_param_array(worker_cpu, charp, &worker_cpu_num, 0444);
+MODULE_PARM_DESC(worker_cpu, "CPU running the transfers of cards as "
+		"slot=cpu (default: any)");
+
+/* Per-card settings are given as slot=value entries, slot being the PCI
+ * name of the card as shown by lspci -D. Minors follow probe order, which
+ * is not stable. */
+static char *default_freq[PCIMAXFM_MAX_DEVS];
+static int default_freq_num = 0;
+module_param_array_named(freq, default_freq, charp, &default_freq_num, 0444);
+MODULE_PARM_DESC(freq, "Frequency of cards as slot=value in 50 KHz steps "
+		"(default: unset)");
+
+static char *default_power[PCIMAXFM_MAX_DEVS];
+static int default_power_num = 0;
+module_param_array_named(power, default_power, charp, &default_power_num,
+		0444);
+MODULE_PARM_DESC(power, "Power of cards as slot=value (default: unset)");
+
+static char *default_stereo[PCIMAXFM_MAX_DEVS];
+static int default_stereo_num = 0;
+module_param_array_named(stereo, default_stereo, charp, &default_stereo_num,
+		0444);
+MODULE_PARM_DESC(stereo, "Stereo encoder of cards as slot=value "
+		"(default: unset)");
+
+#if PCIMAXFM_DETECT_VERSION
+static char *card_version[PCIMAXFM_MAX_DEVS];
+static int card_version_num = 0;
+module_param_array(card_version, charp, &card_version_num, 0444);
+MODULE_PARM_DESC(card_version, "Version of cards as slot=version, version "
+		"being 2004, 2005, 2006 or 2007 (default: "
+		PCIMAXFM_DEVICE_VERSION ")");
+#endif /* PCIMAXFM_DETECT_VERSION */
+
+static const char *pcimaxfm_i2c_profile_name[] = {
+	[PCIMAXFM_I2C_CONSERVATIVE] = "conservative",
+	[PCIMAXFM_I2C_STANDARD]     = "standard",
+	[PCIMAXFM_I2C_FAST]         = "fast",
+	[PCIMAXFM_I2C_CUSTOM]       = "custom"
+};
+
+/* Setup, hold, high and low times. The conservative profile matches the
+ * original fixed 100 usecs per edge, standard and fast are the I2C
+ * specification minimums rounded up to whole microseconds. */
+static struct pcimaxfm_i2c_timing pcimaxfm_i2c_profiles[] = {
+	[PCIMAXFM_I2C_CONSERVATIVE] = { 100, 100, 100, 200 },
+	[PCIMAXFM_I2C_STANDARD]     = {   1,   1,   4,   5 },
+	[PCIMAXFM_I2C_FAST]         = {   1,   1,   1,   2 },
+	[PCIMAXFM_I2C_CUSTOM]       = { 100, 100, 100, 200 }
+};
+
+static int pcimaxfm_i2c_default_profile = PCIMAXFM_I2C_CONSERVATIVE;
+
+void pcimaxfm_i2c_port_set(void *port, int sda, int scl)
 {
-	dev->io_data |= PCIMAXFM_I2C_SCL;
+	struct pcimaxfm_dev *dev = port;
+
+	dev->io_data &= ~(PCIMAXFM_I2C_SDA | PCIMAXFM_I2C_SCL);
+	if (sda)
+		dev->io_data |= PCIMAXFM_I2C_SDA;
+	if (scl)
+		dev->io_data |= PCIMAXFM_I2C_SCL;
+
 	outb(dev->io_data, dev->base_addr + PCIMAXFM_OFFSET_DATA);
 }
 
-static void pcimaxfm_i2c_scl_clr(struct pcimaxfm_dev *dev)
+/* Tri-state SDA and sample the line driven by the target. */
+int pcimaxfm_i2c_port_get_sda(void *port)
 {
-	dev->io_data &= ~PCIMAXFM_I2C_SCL;
-	outb(dev->io_data, dev->base_addr + PCIMAXFM_OFFSET_DATA);
+	struct pcimaxfm_dev *dev = port;
+	u8 data;
+
+	outb(dev->io_ctrl & ~PCIMAXFM_I2C_SDA,
+			dev->base_addr + PCIMAXFM_OFFSET_CTRL);
+	data = inb(dev->base_addr + PCIMAXFM_OFFSET_DATA);
+	outb(dev->io_ctrl, dev->base_addr + PCIMAXFM_OFFSET_CTRL);
+
+	return (data & PCIMAXFM_I2C_SDA) == PCIMAXFM_I2C_SDA;
 }
 
-static void pcimaxfm_i2c_delay(void)
+/* The bus is static, so the clock may be stretched at will. Sleep rather than
+ * spin between edges to leave the CPU to others during long transfers, except
+ * for waits too short to be worth a timer. */
+void pcimaxfm_i2c_port_delay(void *port, unsigned int usecs)
 {
-	udelay(PCIMAXFM_I2C_DELAY_USECS);
+	struct pcimaxfm_dev *dev = port;
+
+	if (usecs < PCIMAXFM_I2C_SLEEP_MIN_USECS) {
+		udelay(usecs);
+		atomic_long_add(usecs, &dev->stats.spin_us);
+	} else
+		usleep_range(usecs, usecs + PCIMAXFM_I2C_DELAY_SLACK_USECS);
 }
 
-static void pcimaxfm_i2c_write_byte(struct pcimaxfm_dev *dev, u8 value)
+/* Hand the bus over between bytes once more urgent work is waiting, see
+ * pcimaxfm_queue_add(), or once the waiter is gone, see
+ * pcimaxfm_queue_wait(). A request resumed after a yield first gets a whole
+ * frame through, or a steady stream of tuning would have it resend the same
+ * frame forever. */
+int pcimaxfm_i2c_port_yield(void *port)
 {
-	int i;
+	struct pcimaxfm_dev *dev = port;
 
-	for (i = 0; i < 8; i++) {
-		if (value & (1 << (7 - i)))
-			pcimaxfm_i2c_sda_set(dev);
-		else
-			pcimaxfm_i2c_sda_clr(dev);
+	if (!dev->yield)
+		return 0;
+
+	if (READ_ONCE(dev->active->cancel))
+		return 1;
 
-		pcimaxfm_i2c_delay();
-		pcimaxfm_i2c_scl_set(dev);
-		pcimaxfm_i2c_delay();
-		pcimaxfm_i2c_scl_clr(dev);
-		pcimaxfm_i2c_delay();
+	return READ_ONCE(dev->preempt) &&
+		(!dev->active->resumed || dev->i2c_frames > 0);
+}
+
+void pcimaxfm_i2c_port_event(void *port, int event, unsigned int value)
+{
+	struct pcimaxfm_dev *dev = port;
+
+	switch (event) {
+		case PCIMAXFM_I2C_EVENT_START:
+			dev->i2c_start = ktime_get();
+			dev->i2c_frames = 0;
+			trace_pcimaxfm_i2c_start(dev->dev_num, value);
+			break;
+		case PCIMAXFM_I2C_EVENT_BYTE:
+			/* Values are printable, so 2 only closes a frame. */
+			if ((value & 0x1ff) == 2)
+				dev->i2c_frames++;
+			trace_pcimaxfm_i2c_byte(dev->dev_num, value & 0xff,
+					value >> 8);
+			break;
+		case PCIMAXFM_I2C_EVENT_STOP:
+			trace_pcimaxfm_i2c_stop(dev->dev_num, ktime_us_delta(
+						ktime_get(), dev->i2c_start));
+			break;
+	}
+}
+
+/* Address-only transaction, returns 0 if the target responded. */
+static int pcimaxfm_bus_ping(struct pcimaxfm_dev *dev, u8 addr)
+{
+	return pcimaxfm_i2c_ping(&dev->i2c, addr) ? -ENXIO : 0;
+}
+
+/* Account a finished transaction. Returns 0 if it went through, -ENXIO if
+ * the target did not acknowledge its address, -EIO if it dropped out
+ * during the data and -EAGAIN if it was cut short to yield the bus. */
+static int pcimaxfm_bus_done(struct pcimaxfm_dev *dev, u8 addr, int ret,
+		ktime_t start)
+{
+	int target = addr == PCIMAXFM_I2C_ADDR_PLL ?
+		PCIMAXFM_STATS_PLL : PCIMAXFM_STATS_RDS;
+	int nack = ret == PCIMAXFM_I2C_NACK_ADDR ||
+		ret == PCIMAXFM_I2C_NACK_DATA;
+
+	atomic_long_add(dev->i2c.attempts, &dev->stats.xfers[target]);
+	atomic_long_add(dev->i2c.sent, &dev->stats.bytes[target]);
+	atomic_long_add(nack ? dev->i2c.attempts : dev->i2c.attempts - 1,
+			&dev->stats.nacks);
+	atomic_long_add(dev->i2c.attempts - 1, &dev->stats.retries);
+	atomic_long_add(ktime_us_delta(ktime_get(), start),
+			&dev->stats.bus_us);
+
+	if (nack) {
+		KMSG_ERRN("No acknowledge from I2C target %#x%s after %u "
+				"attempts.", addr,
+				ret == PCIMAXFM_I2C_NACK_ADDR ? "" : " data",
+				dev->i2c.attempts);
+	}
+
+	switch (ret) {
+		case PCIMAXFM_I2C_ACK:
+			return 0;
+		case PCIMAXFM_I2C_NACK_ADDR:
+			return -ENXIO;
+		case PCIMAXFM_I2C_YIELD:
+			return -EAGAIN;
+		default:
+			return -EIO;
+	}
+}
+
+static int pcimaxfm_bus_write(struct pcimaxfm_dev *dev, u8 addr,
+		const u8 *buf, int len)
+{
+	ktime_t start = ktime_get();
+	int ret = pcimaxfm_i2c_write(&dev->i2c, addr, buf, len);
+
+	return pcimaxfm_bus_done(dev, addr, ret, start);
+}
+
+/* Leave the bus idle after a transaction failed half way. */
+static void pcimaxfm_bus_recover(struct pcimaxfm_dev *dev)
+{
+	if (pcimaxfm_i2c_recover(&dev->i2c))
+		KMSG_ERRN("I2C bus still held low after recovery.");
+}
+
+#if PCIMAXFM_ENABLE_RDS_TOGGLE
+/* Replay a transaction compiled by pcimaxfm_i2c_compile(). */
+static int pcimaxfm_bus_run(struct pcimaxfm_dev *dev,
+		const struct pcimaxfm_i2c_wave *wave)
+{
+	ktime_t start = ktime_get();
+	int ret = pcimaxfm_i2c_run(&dev->i2c, wave);
+
+	return pcimaxfm_bus_done(dev,
+			wave->bytes[0] & ~PCIMAXFM_I2C_ADDR_WRITE_FLAG, ret,
+			start);
+}
+#endif /* PCIMAXFM_ENABLE_RDS_TOGGLE */
+
+static int pcimaxfm_i2c_ping_targets(struct pcimaxfm_dev *dev)
+{
+	int i;
+
+	for (i = 0; i < PCIMAXFM_I2C_CALIBRATE_PINGS; i++) {
+		if (pcimaxfm_bus_ping(dev, PCIMAXFM_I2C_ADDR_PLL))
+			return -EIO;
+		if (pcimaxfm_has(dev, PCIMAXFM_CAP_RDS) &&
+				pcimaxfm_bus_ping(dev, PCIMAXFM_I2C_ADDR_RDS))
+			return -EIO;
 	}
 
-	pcimaxfm_i2c_sda_set(dev);
-	pcimaxfm_i2c_delay();
-	pcimaxfm_i2c_scl_set(dev);
-	pcimaxfm_i2c_delay();
-	pcimaxfm_i2c_scl_clr(dev);
-	pcimaxfm_i2c_delay();
+	return 0;
+}
+
+static void pcimaxfm_i2c_timing_scale(struct pcimaxfm_i2c_timing *t,
+		const struct pcimaxfm_i2c_timing *base, unsigned int mul,
+		unsigned int div)
+{
+	t->setup = clamp_t(unsigned int, base->setup * mul / div, 1,
+			PCIMAXFM_I2C_DELAY_MAX_USECS);
+	t->hold  = clamp_t(unsigned int, base->hold * mul / div, 1,
+			PCIMAXFM_I2C_DELAY_MAX_USECS);
+	t->high  = clamp_t(unsigned int, base->high * mul / div, 1,
+			PCIMAXFM_I2C_DELAY_MAX_USECS);
+	t->low   = clamp_t(unsigned int, base->low * mul / div, 1,
+			PCIMAXFM_I2C_DELAY_MAX_USECS);
 }
 
-static void pcimaxfm_i2c_start(struct pcimaxfm_dev *dev, u8 addr)
+/* Halve the conservative timing until the targets stop acknowledging, then
+ * back off from the fastest working timing by the safety margin. */
+static int pcimaxfm_i2c_calibrate(struct pcimaxfm_dev *dev)
 {
-	pcimaxfm_i2c_delay();
-	pcimaxfm_i2c_sda_set(dev);
-	pcimaxfm_i2c_scl_set(dev);
-	pcimaxfm_i2c_delay();
-	pcimaxfm_i2c_sda_clr(dev);
-	pcimaxfm_i2c_delay();
-	pcimaxfm_i2c_scl_clr(dev);
-	pcimaxfm_i2c_delay();
+	const struct pcimaxfm_i2c_timing *base =
+		&pcimaxfm_i2c_profiles[PCIMAXFM_I2C_CONSERVATIVE];
+	struct pcimaxfm_i2c_timing good = *base;
+	unsigned int div;
+
+	dev->i2c.timing = good;
+
+	if (pcimaxfm_i2c_ping_targets(dev)) {
+		KMSG_ERRN("I2C calibration failed, no response from targets.");
+		dev->i2c.timing = pcimaxfm_i2c_profiles[dev->i2c_profile];
+		return -EIO;
+	}
+
+	for (div = 2; div <= base->low; div *= 2) {
+		pcimaxfm_i2c_timing_scale(&dev->i2c.timing, base, 1, div);
+
+		if (pcimaxfm_i2c_ping_targets(dev))
+			break;
+
+		good = dev->i2c.timing;
+	}
 
-	pcimaxfm_i2c_write_byte(dev, addr);
+	pcimaxfm_i2c_timing_scale(&dev->i2c.timing, &good,
+			PCIMAXFM_I2C_CALIBRATE_MARGIN, 1);
+	dev->i2c_profile = PCIMAXFM_I2C_CUSTOM;
+
+	KMSG_INFON("I2C calibrated: setup %u hold %u high %u low %u usecs",
+			dev->i2c.timing.setup, dev->i2c.timing.hold,
+			dev->i2c.timing.high, dev->i2c.timing.low);
+
+	return 0;
 }
 
-static void pcimaxfm_i2c_stop(struct pcimaxfm_dev *dev)
+static void pcimaxfm_stats_latency(atomic_long_t *hist, ktime_t start)
 {
-	pcimaxfm_i2c_sda_clr(dev);
-	pcimaxfm_i2c_delay();
-	pcimaxfm_i2c_scl_set(dev);
-	pcimaxfm_i2c_delay();
-	pcimaxfm_i2c_sda_set(dev);
+	s64 usecs = ktime_us_delta(ktime_get(), start);
+	int bucket = usecs > 0 ? fls64(usecs) : 0;
+
+	atomic_long_inc(&hist[min(bucket, PCIMAXFM_STATS_BUCKETS - 1)]);
 }
 
-static void pcimaxfm_write_freq_power(struct pcimaxfm_dev *dev,
+static int pcimaxfm_write_freq_power(struct pcimaxfm_dev *dev,
 		int freq, int power)
 {
-	if (freq == PCIMAXFM_FREQ_NA)
-		dev->freq = PCIMAXFM_FREQ_DEFAULT;
-	else if (freq < PCIMAXFM_FREQ_MIN)
-		dev->freq = PCIMAXFM_FREQ_MIN;
-	else if (freq > PCIMAXFM_FREQ_MAX)
-		dev->freq = PCIMAXFM_FREQ_MAX;
-	else
-		dev->freq = freq;
-
-	if (power == PCIMAXFM_POWER_NA)
-		dev->power = PCIMAXFM_POWER_MIN;
-	else if (power < PCIMAXFM_POWER_MIN)
-		dev->power = PCIMAXFM_POWER_MIN;
-	else if (power > PCIMAXFM_POWER_MAX)
-		dev->power = PCIMAXFM_POWER_MAX;
-	else
-		dev->power = power;
+	int ret, len;
+	u8 buf[4];
+	ktime_t start = ktime_get();
+
+	len = pcimaxfm_pll_frame(buf, &freq, &power);
+
+	ret = pcimaxfm_bus_write(dev, PCIMAXFM_I2C_ADDR_PLL, buf, len);
+	pcimaxfm_stats_latency(dev->stats.freq_power_us, start);
 
-	pcimaxfm_i2c_start(dev,
-			PCIMAXFM_I2C_ADDR_PLL | PCIMAXFM_I2C_ADDR_WRITE_FLAG);
-	pcimaxfm_i2c_write_byte(dev, PCIMAXFM_GET_MSB(dev->freq));
-	pcimaxfm_i2c_write_byte(dev, PCIMAXFM_GET_LSB(dev->freq));
-	pcimaxfm_i2c_write_byte(dev, 192);
-	pcimaxfm_i2c_write_byte(dev, dev->power);
-	pcimaxfm_i2c_stop(dev);
+	if (ret)
+		return ret;
+
+	dev->freq  = freq;
+	dev->power = power;
 
 	KMSG_DEBUGN("Frequency: %d Power: %d", dev->freq, dev->power);
+
+	return 0;
 }
 
 #if PCIMAXFM_ENABLE_RDS
-static void pcimaxfm_write_rds(struct pcimaxfm_dev *dev,
-		const char *parameter, const char *value)
+/* Copy an RDS value from userspace and check it against its parameter. */
+static int pcimaxfm_rds_copy_value(struct pcimaxfm_dev *dev, int param,
+		const char __user *uval, char *val)
+{
+	long len;
+
+	if ((len = strncpy_from_user(val, uval,
+					PCIMAXFM_RDS_VALUE_MAX + 1)) < 0)
+		return -EFAULT;
+
+	if (len > PCIMAXFM_RDS_VALUE_MAX || validate_rds(param, val, 0, NULL)) {
+		KMSG_ERRN("Invalid RDS set received.");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int pcimaxfm_rds_cached(struct pcimaxfm_dev *dev, int param,
+		const char *value)
+{
+	return !test_bit(param, dev->rds_dirty) &&
+		!strcmp(dev->rds[param], value);
+}
+
+static void pcimaxfm_rds_cache(struct pcimaxfm_dev *dev, int param,
+		const char *value)
+{
+	write_seqcount_begin(&dev->state_seq);
+	strlcpy(dev->rds[param], value, sizeof(dev->rds[param]));
+	set_bit(param, dev->rds_dirty);
+	write_seqcount_end(&dev->state_seq);
+}
+
+/* Stream the frames of parameters not already held by the encoder in a single
+ * transaction. If it yields the bus, the parameters whose frames went through
+ * whole are settled and the rest stay dirty, so running the batch again
+ * picks up at the start of the interrupted frame. The encoder drops a partial
+ * frame on the opening byte of the next, as modelled by the bench's
+ * sim_rds_feed(). */
+static int pcimaxfm_write_rds_batch(struct pcimaxfm_dev *dev,
+		const struct pcimaxfm_rds_value *rds, int count)
+{
+	int i, ret = 0, len = 0, acked;
+	DECLARE_BITMAP(sent, RDS_PARAM_END);
+	int end[RDS_PARAM_END];
+	u8 *buf;
+	ktime_t start;
+
+	if ((buf = kmalloc(count * PCIMAXFM_RDS_FRAME_MAX, GFP_KERNEL)) == NULL)
+		return -ENOMEM;
+
+	bitmap_zero(sent, RDS_PARAM_END);
+
+	for (i = 0; i < count; i++) {
+		if (pcimaxfm_rds_cached(dev, rds[i].param, rds[i].value))
+			continue;
+
+		pcimaxfm_rds_cache(dev, rds[i].param, rds[i].value);
+		set_bit(rds[i].param, sent);
+
+		len += pcimaxfm_rds_frame(buf + len,
+				rds_params_name[rds[i].param], rds[i].value);
+		end[rds[i].param] = len;
+	}
+
+	if (len == 0)
+		goto batch_done;
+
+	start = ktime_get();
+	ret = pcimaxfm_bus_write(dev, PCIMAXFM_I2C_ADDR_RDS, buf, len);
+	pcimaxfm_stats_latency(dev->stats.rds_us, start);
+
+	if (ret == -EAGAIN)
+		acked = dev->i2c.acked;
+	else if (ret)
+		goto batch_done;
+	else
+		acked = len;
+
+	write_seqcount_begin(&dev->state_seq);
+	for_each_set_bit(i, sent, RDS_PARAM_END) {
+		if (end[i] <= acked)
+			clear_bit(i, dev->rds_dirty);
+	}
+	write_seqcount_end(&dev->state_seq);
+
+	KMSG_DEBUGN("RDS: %d parameters", count);
+
+batch_done:
+	kfree(buf);
+
+	return ret;
+}
+
+#if PCIMAXFM_ENABLE_RDS_TOGGLE
+static void pcimaxfm_rds_pwr_compile(struct pcimaxfm_dev *dev)
+{
+	u8 buf[PCIMAXFM_RDS_FRAME_MAX];
+	int signal, len;
+
+	for (signal = 0; signal < 2; signal++) {
+		len = pcimaxfm_rds_frame(buf, "PWR", signal ? "1" : "0");
+		pcimaxfm_i2c_compile(&dev->rds_pwr[signal],
+				PCIMAXFM_I2C_ADDR_RDS, buf, len);
+	}
+}
+
+static int pcimaxfm_rdssignal_set(struct pcimaxfm_dev *dev, int signal)
+{
+	int ret;
+	ktime_t start = ktime_get();
+
+	signal = signal ? 1 : 0;
+
+	ret = pcimaxfm_bus_run(dev, &dev->rds_pwr[signal]);
+	pcimaxfm_stats_latency(dev->stats.rds_us, start);
+
+	if (ret)
+		return ret;
+
+	dev->rdssignal = signal;
+
+	KMSG_DEBUGN("RDS: PWR = \"%d\"", signal);
+
+	return 0;
+}
+#endif /* PCIMAXFM_ENABLE_RDS_TOGGLE */
+#endif /* PCIMAXFM_ENABLE_RDS */
+
+#if PCIMAXFM_ENABLE_TX_TOGGLE
+static void pcimaxfm_tx_set(struct pcimaxfm_dev *dev, int tx)
+{
+	if (tx) {
+		dev->io_data |= PCIMAXFM_TX;
+	} else {
+		dev->io_data &= ~PCIMAXFM_TX;
+	}
+
+	outb(dev->io_data, dev->base_addr + PCIMAXFM_OFFSET_DATA);
+}
+
+static int pcimaxfm_tx_get(const struct pcimaxfm_state *state)
+{
+	return (state->io_data & PCIMAXFM_TX) == PCIMAXFM_TX;
+}
+#endif /* PCIMAXFM_ENABLE_TX_TOGGLE */
+
+static void pcimaxfm_stereo_set(struct pcimaxfm_dev *dev, int stereo)
+{
+	if (pcimaxfm_has(dev, PCIMAXFM_CAP_INV_STEREO))
+		stereo = !stereo;
+
+	if (stereo) {
+		dev->io_data &= ~PCIMAXFM_MONO;
+	} else {
+		dev->io_data |= PCIMAXFM_MONO;
+	}
+
+	outb(dev->io_data, dev->base_addr + PCIMAXFM_OFFSET_DATA);
+}
+
+static int pcimaxfm_stereo_get(const struct pcimaxfm_dev *dev,
+		const struct pcimaxfm_state *state)
+{
+	int stereo = ((state->io_data & PCIMAXFM_MONO) != PCIMAXFM_MONO);
+
+	if (pcimaxfm_has(dev, PCIMAXFM_CAP_INV_STEREO))
+		return !stereo;
+
+	return stereo;
+}
+
+/* Optional features the card has, as PCIMAXFM_STATUS_ flags. */
+static int pcimaxfm_status_flags(const struct pcimaxfm_dev *dev)
+{
+	int flags = 0;
+
+	if (pcimaxfm_has(dev, PCIMAXFM_CAP_TX))
+		flags |= PCIMAXFM_STATUS_TX;
+	if (pcimaxfm_has(dev, PCIMAXFM_CAP_RDS))
+		flags |= PCIMAXFM_STATUS_RDS;
+	if (pcimaxfm_has(dev, PCIMAXFM_CAP_RDSSIGNAL))
+		flags |= PCIMAXFM_STATUS_RDSSIGNAL;
+
+	return flags;
+}
+
+static unsigned int pcimaxfm_stats_sum(const atomic_long_t *counters, int n)
+{
+	unsigned long sum = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		sum += atomic_long_read(&counters[i]);
+
+	return sum;
+}
+
+/* Copy the published state to the shared status page, bracketed by odd
+ * values of its sequence count for lockless readers. Called from
+ * pcimaxfm_state_publish(). */
+static void pcimaxfm_shm_publish(struct pcimaxfm_dev *dev)
 {
-	char *parm = (char*)parameter, *val = (char*)value;
+	struct pcimaxfm_shm *shm = dev->shm;
+#if PCIMAXFM_ENABLE_RDS
+	int i;
+#endif /* PCIMAXFM_ENABLE_RDS */
 
-	pcimaxfm_i2c_start(dev,
-			PCIMAXFM_I2C_ADDR_RDS | PCIMAXFM_I2C_ADDR_WRITE_FLAG);
+	WRITE_ONCE(shm->seq, shm->seq + 1);
+	smp_wmb();
+
+	shm->version   = PCIMAXFM_SHM_VERSION;
+	shm->flags     = pcimaxfm_status_flags(dev);
+	shm->freq      = dev->state.freq;
+	shm->power     = dev->state.power;
+	shm->tx        = PCIMAXFM_BOOL_NA;
+	shm->stereo    = pcimaxfm_stereo_get(dev, &dev->state);
+	shm->rdssignal = PCIMAXFM_BOOL_NA;
+	shm->io_ctrl   = dev->state.io_ctrl;
+	shm->io_data   = dev->state.io_data;
+	shm->xfers     = pcimaxfm_stats_sum(dev->stats.xfers,
+			PCIMAXFM_STATS_TARGETS);
+	shm->bytes     = pcimaxfm_stats_sum(dev->stats.bytes,
+			PCIMAXFM_STATS_TARGETS);
+	shm->nacks     = atomic_long_read(&dev->stats.nacks);
+	shm->retries   = atomic_long_read(&dev->stats.retries);
 
-	pcimaxfm_i2c_write_byte(dev, 0);
-	while (*parm)
-		pcimaxfm_i2c_write_byte(dev, *parm++);
+#if PCIMAXFM_ENABLE_TX_TOGGLE
+	if (pcimaxfm_has(dev, PCIMAXFM_CAP_TX))
+		shm->tx = pcimaxfm_tx_get(&dev->state);
+#endif /* PCIMAXFM_ENABLE_TX_TOGGLE */
+#if PCIMAXFM_ENABLE_RDS_TOGGLE
+	if (pcimaxfm_has(dev, PCIMAXFM_CAP_RDSSIGNAL))
+		shm->rdssignal = dev->state.rdssignal;
+#endif /* PCIMAXFM_ENABLE_RDS_TOGGLE */
 
-	pcimaxfm_i2c_write_byte(dev, 1);
-	while (*val)
-		pcimaxfm_i2c_write_byte(dev, *val++);
+#if PCIMAXFM_ENABLE_RDS
+	memcpy(shm->rds, dev->rds, sizeof(shm->rds));
+	memset(shm->rds_dirty, 0, sizeof(shm->rds_dirty));
 
-	pcimaxfm_i2c_write_byte(dev, 2);
-	pcimaxfm_i2c_stop(dev);
+	for_each_set_bit(i, dev->rds_dirty, RDS_PARAM_END)
+		shm->rds_dirty[i / 32] |= 1u << (i % 32);
+#endif /* PCIMAXFM_ENABLE_RDS */
 
-	KMSG_DEBUGN("RDS: %s = \"%s\"", parameter, value);
+	smp_wmb();
+	WRITE_ONCE(shm->seq, shm->seq + 1);
 }
 
+/* Called with bus_lock held once the ports are idle. */
+static void pcimaxfm_state_publish(struct pcimaxfm_dev *dev)
+{
+	write_seqcount_begin(&dev->state_seq);
+	dev->state.freq      = dev->freq;
+	dev->state.power     = dev->power;
 #if PCIMAXFM_ENABLE_RDS_TOGGLE
-static void pcimaxfm_rdssignal_set(struct pcimaxfm_dev *dev, int signal)
+	dev->state.rdssignal = dev->rdssignal;
+#endif /* PCIMAXFM_ENABLE_RDS_TOGGLE */
+	dev->state.io_ctrl   = dev->io_ctrl;
+	dev->state.io_data   = dev->io_data;
+	write_seqcount_end(&dev->state_seq);
+
+	pcimaxfm_shm_publish(dev);
+}
+
+static void pcimaxfm_state_read(struct pcimaxfm_dev *dev,
+		struct pcimaxfm_state *state)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&dev->state_seq);
+		*state = dev->state;
+	} while (read_seqcount_retry(&dev->state_seq, seq));
+}
+
+/* Sequence numbers handed to userspace are positive ints, wrapping to 1. */
+static unsigned int pcimaxfm_seq_next(unsigned int seq)
+{
+	seq = (seq + 1) & PCIMAXFM_SEQ_MASK;
+
+	return seq ? seq : 1;
+}
+
+/* Nonzero if sequence number a was handed out after b. */
+static int pcimaxfm_seq_after(unsigned int a, unsigned int b)
+{
+	unsigned int diff = (a - b) & PCIMAXFM_SEQ_MASK;
+
+	return diff != 0 && diff < (PCIMAXFM_SEQ_MASK >> 1);
+}
+
+static int pcimaxfm_seq_done(struct pcimaxfm_dev *dev, unsigned int seq)
+{
+	int done;
+
+	spin_lock(&dev->queue_lock);
+	done = !pcimaxfm_seq_after(seq, dev->done_seq);
+	spin_unlock(&dev->queue_lock);
+
+	return done;
+}
+
+static int pcimaxfm_request_done(struct pcimaxfm_dev *dev,
+		struct pcimaxfm_request *req)
 {
-	char valstr[2];
+	int done;
+
+	spin_lock(&dev->queue_lock);
+	done = req->done;
+	spin_unlock(&dev->queue_lock);
+
+	return done;
+}
+
+static int pcimaxfm_queue_space(struct pcimaxfm_dev *dev)
+{
+	return READ_ONCE(dev->queue_len) < PCIMAXFM_QUEUE_DEPTH;
+}
+
+static size_t pcimaxfm_request_size(int count)
+{
+	size_t size = sizeof(struct pcimaxfm_request);
+
+#if PCIMAXFM_ENABLE_RDS
+	size += count * sizeof(struct pcimaxfm_rds_value);
+#endif /* PCIMAXFM_ENABLE_RDS */
+
+	return size;
+}
+
+static struct pcimaxfm_request *pcimaxfm_request_alloc(int type, int data,
+		int count)
+{
+	struct pcimaxfm_request *req;
+
+	if ((req = kzalloc(pcimaxfm_request_size(count), GFP_KERNEL)) == NULL)
+		return NULL;
+
+	req->type = type;
+	req->data = data;
+#if PCIMAXFM_ENABLE_RDS
+	req->count = count;
+#endif /* PCIMAXFM_ENABLE_RDS */
+
+	return req;
+}
+
+static int pcimaxfm_request_lane(int type)
+{
+	switch (type) {
+		case PCIMAXFM_REQ_TX:
+		case PCIMAXFM_REQ_FREQ:
+		case PCIMAXFM_REQ_POWER:
+			return PCIMAXFM_LANE_TUNE;
+		case PCIMAXFM_REQ_STEREO:
+		case PCIMAXFM_REQ_RDSSIGNAL:
+		case PCIMAXFM_REQ_PING:
+			return PCIMAXFM_LANE_TOGGLE;
+		default:
+			return PCIMAXFM_LANE_RDS;
+	}
+}
+
+/* Bytes a request is expected to put on the bus, charged to its opener. */
+static unsigned int pcimaxfm_request_cost(const struct pcimaxfm_request *req)
+{
+#if PCIMAXFM_ENABLE_RDS
+	unsigned int cost = 0;
+	int i;
+
+	if (req->type == PCIMAXFM_REQ_RDS) {
+		for (i = 0; i < req->count; i++)
+			cost += 3 + strlen(rds_params_name[req->rds[i].param]) +
+				strlen(req->rds[i].value);
+
+		return cost;
+	}
+#endif /* PCIMAXFM_ENABLE_RDS */
+
+	/* A PLL frame. */
+	return 4;
+}
+
+/* Features a request needs from the card. */
+static unsigned int pcimaxfm_request_caps(int type)
+{
+	switch (type) {
+		case PCIMAXFM_REQ_TX:
+			return PCIMAXFM_CAP_TX;
+		case PCIMAXFM_REQ_RDSSIGNAL:
+			return PCIMAXFM_CAP_RDSSIGNAL;
+		case PCIMAXFM_REQ_RDS:
+			return PCIMAXFM_CAP_RDS;
+		default:
+			return 0;
+	}
+}
+
+static int pcimaxfm_request_exec(struct pcimaxfm_dev *dev,
+		struct pcimaxfm_request *req)
+{
+	switch (req->type) {
+#if PCIMAXFM_ENABLE_TX_TOGGLE
+		case PCIMAXFM_REQ_TX:
+			pcimaxfm_tx_set(dev, req->data);
+			return 0;
+#endif /* PCIMAXFM_ENABLE_TX_TOGGLE */
+
+		case PCIMAXFM_REQ_FREQ:
+			return pcimaxfm_write_freq_power(dev,
+					req->data, dev->power);
+
+		case PCIMAXFM_REQ_POWER:
+			return pcimaxfm_write_freq_power(dev,
+					dev->freq, req->data);
+
+		case PCIMAXFM_REQ_STEREO:
+			pcimaxfm_stereo_set(dev, req->data);
+			return 0;
+
+#if PCIMAXFM_ENABLE_RDS
+#if PCIMAXFM_ENABLE_RDS_TOGGLE
+		case PCIMAXFM_REQ_RDSSIGNAL:
+			return pcimaxfm_rdssignal_set(dev, req->data);
+#endif /* PCIMAXFM_ENABLE_RDS_TOGGLE */
+
+		case PCIMAXFM_REQ_RDS:
+			return pcimaxfm_write_rds_batch(dev,
+					req->rds, req->count);
+#endif /* PCIMAXFM_ENABLE_RDS */
+
+		case PCIMAXFM_REQ_PING:
+			return pcimaxfm_bus_ping(dev, req->data);
+
+		case PCIMAXFM_REQ_CALIBRATE:
+			return pcimaxfm_i2c_calibrate(dev);
+	}
+
+	return -EINVAL;
+}
+
+/* Replay the cached settings after the card lost them, tuning first and RDS
+ * text last, leaving out whatever was never set. A failed replay is tried
+ * again on the next run of the work item. Called with bus_lock held. */
+static void pcimaxfm_restore(struct pcimaxfm_dev *dev)
+{
+	int ret = 0;
+	ktime_t start = ktime_get();
+#if PCIMAXFM_ENABLE_RDS
+	int i, count = 0;
+	struct pcimaxfm_rds_value *rds;
+#endif /* PCIMAXFM_ENABLE_RDS */
+
+	if (!dev->restore)
+		return;
+
+	if (dev->freq != PCIMAXFM_FREQ_NA || dev->power != PCIMAXFM_POWER_NA)
+		ret = pcimaxfm_write_freq_power(dev, dev->freq, dev->power);
+
+#if PCIMAXFM_ENABLE_RDS
+#if PCIMAXFM_ENABLE_RDS_TOGGLE
+	if (!ret && pcimaxfm_has(dev, PCIMAXFM_CAP_RDSSIGNAL) &&
+			dev->rdssignal != PCIMAXFM_BOOL_NA)
+		ret = pcimaxfm_rdssignal_set(dev, dev->rdssignal);
+#endif /* PCIMAXFM_ENABLE_RDS_TOGGLE */
+
+	if (!ret && pcimaxfm_has(dev, PCIMAXFM_CAP_RDS)) {
+		if ((rds = kmalloc(RDS_PARAM_END * sizeof(*rds),
+						GFP_KERNEL)) == NULL) {
+			ret = -ENOMEM;
+			goto restore_done;
+		}
+
+		/* Nothing on the encoder is known any more. */
+		write_seqcount_begin(&dev->state_seq);
+		bitmap_fill(dev->rds_dirty, RDS_PARAM_END);
+		write_seqcount_end(&dev->state_seq);
+
+		for (i = 0; i < RDS_PARAM_END; i++) {
+			if (dev->rds[i][0] == '\0')
+				continue;
+
+			rds[count].param = i;
+			strlcpy(rds[count].value, dev->rds[i],
+					sizeof(rds[count].value));
+			count++;
+		}
+
+		if (count > 0)
+			ret = pcimaxfm_write_rds_batch(dev, rds, count);
+
+		kfree(rds);
+	}
+
+restore_done:
+#endif /* PCIMAXFM_ENABLE_RDS */
+	if (ret) {
+		KMSG_ERRN("Couldn't restore settings (%d).", ret);
+		return;
+	}
+
+	dev->restore = 0;
+
+	KMSG_DEBUGN("Settings restored in %lld usecs.",
+			ktime_us_delta(ktime_get(), start));
+}
+
+/* Take the request to run next off its lane. Called with queue_lock held. */
+static struct pcimaxfm_request *pcimaxfm_queue_next(struct pcimaxfm_dev *dev)
+{
+	struct pcimaxfm_request *req, *next = NULL;
+	int lane;
+
+	for (lane = 0; lane < PCIMAXFM_LANES && next == NULL; lane++) {
+		list_for_each_entry(req, &dev->lanes[lane], list) {
+			if (next == NULL || req->vstart < next->vstart)
+				next = req;
+		}
+	}
+
+	if (next) {
+		list_del(&next->list);
+		dev->queue_len--;
+		dev->lane_vtime[next->lane] = next->vstart;
+	}
+
+	dev->preempt = 0;
+
+	return next;
+}
+
+/* Requests complete out of order across lanes, so done_seq is the last
+ * sequence number before the oldest one still pending. Called with
+ * queue_lock held. */
+static void pcimaxfm_queue_done(struct pcimaxfm_dev *dev)
+{
+	struct pcimaxfm_request *req;
+	unsigned int oldest = 0;
+	int lane;
+
+	if (dev->active)
+		oldest = dev->active->seq;
+
+	for (lane = 0; lane < PCIMAXFM_LANES; lane++) {
+		list_for_each_entry(req, &dev->lanes[lane], list) {
+			if (oldest == 0 || pcimaxfm_seq_after(oldest, req->seq))
+				oldest = req->seq;
+		}
+	}
+
+	dev->done_seq = oldest ? (oldest - 1) & PCIMAXFM_SEQ_MASK : dev->seq;
+}
+
+static void pcimaxfm_queue_work(struct work_struct *work)
+{
+	int result;
+	struct pcimaxfm_dev *dev = container_of(work, struct pcimaxfm_dev,
+			work);
+	struct pcimaxfm_request *req;
+	ktime_t start;
+
+	/* Lost settings go back before any request. */
+	mutex_lock(&dev->bus_lock);
+	pcimaxfm_restore(dev);
+	pcimaxfm_state_publish(dev);
+	mutex_unlock(&dev->bus_lock);
+
+	spin_lock(&dev->queue_lock);
+
+	while ((req = pcimaxfm_queue_next(dev))) {
+		dev->active = req;
+		spin_unlock(&dev->queue_lock);
+
+		start = ktime_get();
+
+		mutex_lock(&dev->bus_lock);
+		pcimaxfm_restore(dev);
+		dev->yield = req->type == PCIMAXFM_REQ_RDS;
+		result = pcimaxfm_request_exec(dev, req);
+		dev->yield = 0;
+		/* A yield already ended its transaction with a STOP, only a
+		 * failed one may have left a target holding SDA. */
+		if (result == -EIO)
+			pcimaxfm_bus_recover(dev);
+		else if (result == -EAGAIN && READ_ONCE(req->cancel))
+			result = -EINTR;
+		pcimaxfm_state_publish(dev);
+		mutex_unlock(&dev->bus_lock);
+
+		spin_lock(&dev->queue_lock);
+		dev->active = NULL;
+
+		/* Gave the bus up: back to the head of its lane, keeping its
+		 * place among the opener's requests. */
+		if (result == -EAGAIN) {
+			req->resumed = 1;
+			list_add(&req->list, &dev->lanes[req->lane]);
+			dev->queue_len++;
+			continue;
+		}
+
+		trace_pcimaxfm_request_done(dev->dev_num, req->seq, req->type,
+				result, ktime_us_delta(ktime_get(), start));
+
+		pcimaxfm_queue_done(dev);
+		req->result = result;
+
+		/* Nonblocking submitters learn about errors on their next
+		 * fence. */
+		if (result && !req->waiter && !req->cancel && req->client &&
+				!req->client->error)
+			req->client->error = result;
+
+		if (req->waiter)
+			req->done = 1;
+		else
+			kfree(req);
+
+		wake_up_all(&dev->queue_wait);
+	}
+
+	spin_unlock(&dev->queue_lock);
+}
+
+/* Called with queue_lock held, so that removal can't destroy the worker in
+ * between. */
+static void pcimaxfm_queue_kick(struct pcimaxfm_dev *dev)
+{
+	if (dev->cpu >= 0)
+		queue_work_on(dev->cpu, dev->wq, &dev->work);
+	else
+		queue_work(dev->wq, &dev->work);
+}
+
+/* Queue a request and return its sequence number. Unless nonblock is set,
+ * wait for room in the queue and leave the request for the submitter to
+ * collect with pcimaxfm_queue_wait(). */
+static int pcimaxfm_queue_add(struct pcimaxfm_dev *dev,
+		struct pcimaxfm_client *client, struct pcimaxfm_request *req,
+		int nonblock)
+{
+	int ret;
+	u64 *vfinish;
+
+	if (!pcimaxfm_has(dev, pcimaxfm_request_caps(req->type))) {
+		kfree(req);
+		return -EOPNOTSUPP;
+	}
+
+	spin_lock(&dev->queue_lock);
+
+	while (dev->queue_len >= PCIMAXFM_QUEUE_DEPTH && !dev->gone) {
+		spin_unlock(&dev->queue_lock);
+
+		if (nonblock) {
+			kfree(req);
+			return -EAGAIN;
+		}
+
+		if (wait_event_interruptible(dev->queue_wait,
+					pcimaxfm_queue_space(dev) ||
+					READ_ONCE(dev->gone))) {
+			kfree(req);
+			return -ERESTARTSYS;
+		}
+
+		spin_lock(&dev->queue_lock);
+	}
+
+	if (dev->gone) {
+		spin_unlock(&dev->queue_lock);
+		kfree(req);
+		return -ENODEV;
+	}
+
+	dev->seq = pcimaxfm_seq_next(dev->seq);
+	req->seq = dev->seq;
+	req->client = client;
+	req->waiter = !nonblock;
+
+	if (client)
+		client->seq = req->seq;
+
+	vfinish = client ? client->vfinish : dev->vfinish;
+	req->lane = pcimaxfm_request_lane(req->type);
+	req->vstart = max(dev->lane_vtime[req->lane], vfinish[req->lane]);
+	vfinish[req->lane] = req->vstart + pcimaxfm_request_cost(req);
+
+	/* RDS text in flight stops at the next byte for tuning and toggles. */
+	if (dev->active && req->lane < dev->active->lane)
+		WRITE_ONCE(dev->preempt, 1);
+
+	list_add_tail(&req->list, &dev->lanes[req->lane]);
+	dev->queue_len++;
+	ret = req->seq;
+
+	trace_pcimaxfm_request_queue(dev->dev_num, req->seq, req->type,
+			dev->queue_len);
+
+	pcimaxfm_queue_kick(dev);
+
+	spin_unlock(&dev->queue_lock);
+
+	return ret;
+}
+
+/* Collect the result of a request queued with a waiter. A signal cancels
+ * it: a request still queued is dropped, one on the bus stops at the next
+ * byte and is left for the work item to free. */
+static int pcimaxfm_queue_wait(struct pcimaxfm_dev *dev,
+		struct pcimaxfm_request *req)
+{
+	int ret;
+
+	if (wait_event_interruptible(dev->queue_wait,
+				pcimaxfm_request_done(dev, req))) {
+		spin_lock(&dev->queue_lock);
+
+		if (req->done) {
+			spin_unlock(&dev->queue_lock);
+			goto wait_done;
+		}
+
+		if (req == dev->active) {
+			WRITE_ONCE(req->cancel, 1);
+			req->waiter = 0;
+			req = NULL;
+		} else {
+			list_del(&req->list);
+			dev->queue_len--;
+			pcimaxfm_queue_done(dev);
+			wake_up_all(&dev->queue_wait);
+		}
+
+		spin_unlock(&dev->queue_lock);
+		kfree(req);
+
+		return -ERESTARTSYS;
+	}
+
+wait_done:
+	ret = req->result;
+	kfree(req);
+
+	return ret;
+}
+
+/* Queue a request. A blocking submitter waits for and gets its result,
+ * a nonblocking one gets its sequence number right away. */
+static int pcimaxfm_queue_submit(struct pcimaxfm_dev *dev,
+		struct pcimaxfm_client *client, struct pcimaxfm_request *req,
+		int nonblock)
+{
+	int ret;
+
+	if ((ret = pcimaxfm_queue_add(dev, client, req, nonblock)) < 0 ||
+			nonblock)
+		return ret;
+
+	return pcimaxfm_queue_wait(dev, req);
+}
+
+static int pcimaxfm_submit(struct file *filp, struct pcimaxfm_request *req)
+{
+	struct pcimaxfm_client *client = pcimaxfm_client(filp);
+
+	if (req == NULL)
+		return -ENOMEM;
+
+	return pcimaxfm_queue_submit(client->dev, client, req,
+			filp->f_flags & O_NONBLOCK);
+}
+
+/* Wait until the given request and all before it are done, then report and
+ * clear the first error of the client's nonblocking requests. A zero seq
+ * waits for the client's last request. */
+static int pcimaxfm_queue_fence(struct file *filp, int seq)
+{
+	int ret;
+	struct pcimaxfm_client *client = pcimaxfm_client(filp);
+	struct pcimaxfm_dev *dev = client->dev;
+
+	spin_lock(&dev->queue_lock);
+
+	if (seq == 0) {
+		seq = client->seq;
+	} else if (seq < 0 || pcimaxfm_seq_after(seq, dev->seq)) {
+		spin_unlock(&dev->queue_lock);
+		return -EINVAL;
+	}
+
+	spin_unlock(&dev->queue_lock);
+
+	if (filp->f_flags & O_NONBLOCK) {
+		if (!pcimaxfm_seq_done(dev, seq))
+			return -EAGAIN;
+	} else if (wait_event_interruptible(dev->queue_wait,
+				pcimaxfm_seq_done(dev, seq))) {
+		return -ERESTARTSYS;
+	}
+
+	spin_lock(&dev->queue_lock);
+	ret = client->error;
+	client->error = 0;
+	spin_unlock(&dev->queue_lock);
+
+	return ret;
+}
+
+static void pcimaxfm_queue_status(struct pcimaxfm_client *client,
+		struct pcimaxfm_queue_status *status)
+{
+	struct pcimaxfm_dev *dev = client->dev;
+
+	spin_lock(&dev->queue_lock);
+	status->depth      = dev->queue_len + (dev->active != NULL);
+	status->seq        = dev->seq;
+	status->done_seq   = dev->done_seq;
+	status->client_seq = client->seq;
+	status->error      = client->error;
+	spin_unlock(&dev->queue_lock);
+}
+
+static void pcimaxfm_status_get(struct pcimaxfm_dev *dev,
+		struct pcimaxfm_status *status)
+{
+	unsigned int seq;
+	struct pcimaxfm_state state;
+#if PCIMAXFM_ENABLE_RDS
+	int i;
+#endif /* PCIMAXFM_ENABLE_RDS */
+
+	status->version = PCIMAXFM_STATUS_VERSION;
+	status->flags   = pcimaxfm_status_flags(dev);
+
+	do {
+		seq = read_seqcount_begin(&dev->state_seq);
+		state = dev->state;
+#if PCIMAXFM_ENABLE_RDS
+		memcpy(status->rds, dev->rds, sizeof(status->rds));
+		memset(status->rds_dirty, 0, sizeof(status->rds_dirty));
+
+		for_each_set_bit(i, dev->rds_dirty, RDS_PARAM_END)
+			status->rds_dirty[i / 32] |= 1u << (i % 32);
+#endif /* PCIMAXFM_ENABLE_RDS */
+	} while (read_seqcount_retry(&dev->state_seq, seq));
+
+	status->freq    = state.freq;
+	status->power   = state.power;
+	status->stereo  = pcimaxfm_stereo_get(dev, &state);
+	status->io_ctrl = state.io_ctrl;
+	status->io_data = state.io_data;
+
+	status->tx        = PCIMAXFM_BOOL_NA;
+	status->rdssignal = PCIMAXFM_BOOL_NA;
+
+#if PCIMAXFM_ENABLE_TX_TOGGLE
+	if (pcimaxfm_has(dev, PCIMAXFM_CAP_TX))
+		status->tx = pcimaxfm_tx_get(&state);
+#endif /* PCIMAXFM_ENABLE_TX_TOGGLE */
+
+	if (!pcimaxfm_has(dev, PCIMAXFM_CAP_RDS)) {
+		memset(status->rds, 0, sizeof(status->rds));
+		memset(status->rds_dirty, 0, sizeof(status->rds_dirty));
+	}
+
+#if PCIMAXFM_ENABLE_RDS_TOGGLE
+	if (pcimaxfm_has(dev, PCIMAXFM_CAP_RDSSIGNAL))
+		status->rdssignal = state.rdssignal;
+#endif /* PCIMAXFM_ENABLE_RDS_TOGGLE */
+
+	spin_lock(&dev->queue_lock);
+	status->queue_depth = dev->queue_len + (dev->active != NULL);
+	status->done_seq    = dev->done_seq;
+	spin_unlock(&dev->queue_lock);
+}
+
+#if PCIMAXFM_ENABLE_RDS
+/* Put marks taken by a failed commit back, keeping any set meanwhile. */
+static void pcimaxfm_rds_remark(struct pcimaxfm_rds_stage *stage,
+		const unsigned int *taken)
+{
+	unsigned int old;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(stage->mask); i++) {
+		if (!taken[i])
+			continue;
+
+		do {
+			old = READ_ONCE(stage->mask[i]);
+		} while (cmpxchg(&stage->mask[i], old, old | taken[i]) != old);
+	}
+}
+
+/* Take the values marked in the staging area into a request, clearing their
+ * marks. Values already on the encoder are left out when it runs. Returns
+ * NULL if nothing is marked. A mark past the last parameter or an invalid
+ * value fails the whole commit with -EINVAL and leaves every mark set, so
+ * the commit can be retried once the page is fixed. */
+static struct pcimaxfm_request *pcimaxfm_rds_commit_request(
+		struct pcimaxfm_dev *dev)
+{
+	struct pcimaxfm_rds_stage *stage = dev->rds_stage;
+	unsigned int taken[ARRAY_SIZE(stage->mask)], valid, stray = 0;
+	struct pcimaxfm_request *req;
+	struct pcimaxfm_rds_value *v;
+	int i, ret, count = 0;
+
+	for (i = 0; i < ARRAY_SIZE(taken); i++) {
+		taken[i] = xchg(&stage->mask[i], 0);
+
+		if (RDS_PARAM_END >= 32 * (i + 1))
+			valid = ~0u;
+		else if (RDS_PARAM_END > 32 * i)
+			valid = (1u << (RDS_PARAM_END - 32 * i)) - 1;
+		else
+			valid = 0;
+
+		stray |= taken[i] & ~valid;
+		count += hweight32(taken[i]);
+	}
+
+	if (stray) {
+		KMSG_ERRN("RDS staging marks past the last parameter.");
+		ret = -EINVAL;
+		goto err_remark;
+	}
+
+	if (count == 0)
+		return NULL;
+
+	if ((req = pcimaxfm_request_alloc(PCIMAXFM_REQ_RDS, 0, count)) ==
+			NULL) {
+		ret = -ENOMEM;
+		goto err_remark;
+	}
+
+	req->count = 0;
+
+	for (i = 0; i < RDS_PARAM_END; i++) {
+		if (!(taken[i / 32] & (1u << (i % 32))))
+			continue;
+
+		/* The page may change under us, check the copy. */
+		v = &req->rds[req->count++];
+		v->param = i;
+		memcpy(v->value, stage->rds[i], sizeof(v->value));
+
+		if (v->value[PCIMAXFM_RDS_VALUE_MAX] != '\0' ||
+				validate_rds(i, v->value, 0, NULL)) {
+			KMSG_ERRN("Invalid RDS value staged for %s.",
+					rds_params_name[i]);
+			kfree(req);
+			ret = -EINVAL;
+			goto err_remark;
+		}
+	}
+
+	return req;
+
+err_remark:
+	pcimaxfm_rds_remark(stage, taken);
+
+	return ERR_PTR(ret);
+}
+
+/* Copy and validate every parameter of a batch into a request. */
+static struct pcimaxfm_request *pcimaxfm_rds_batch_request(
+		struct pcimaxfm_dev *dev, const struct pcimaxfm_rds_batch *batch)
+{
+	int i, ret = 0;
+	struct pcimaxfm_rds_set *sets;
+	struct pcimaxfm_request *req;
+
+	if (batch->count < 1 || batch->count > PCIMAXFM_RDS_BATCH_MAX)
+		return ERR_PTR(-EINVAL);
+
+	sets = kmalloc(batch->count * sizeof(*sets), GFP_KERNEL);
+	req  = pcimaxfm_request_alloc(PCIMAXFM_REQ_RDS, 0, batch->count);
+
+	if (sets == NULL || req == NULL) {
+		ret = -ENOMEM;
+		goto batch_done;
+	}
+
+	if (copy_from_user(sets, (struct pcimaxfm_rds_set __user *)batch->sets,
+				batch->count * sizeof(*sets))) {
+		ret = -EFAULT;
+		goto batch_done;
+	}
+
+	for (i = 0; i < batch->count; i++) {
+		req->rds[i].param = sets[i].param;
+
+		if ((ret = pcimaxfm_rds_copy_value(dev, sets[i].param,
+				(const char __user *)sets[i].value,
+				req->rds[i].value)))
+			goto batch_done;
+	}
+
+batch_done:
+	kfree(sets);
+
+	if (ret) {
+		kfree(req);
+		return ERR_PTR(ret);
+	}
+
+	return req;
+}
+
+/* Terminate an inline RDS value and check it against its parameter. */
+static int pcimaxfm_rds_value2(struct pcimaxfm_dev *dev,
+		const struct pcimaxfm_rds_set2 *set,
+		struct pcimaxfm_rds_value *val)
+{
+	if (set->len < 0 || set->len > PCIMAXFM_RDS_VALUE_MAX ||
+			memchr(set->value, '\0', set->len)) {
+		KMSG_ERRN("Invalid RDS set received.");
+		return -EINVAL;
+	}
+
+	val->param = set->param;
+	memcpy(val->value, set->value, set->len);
+	val->value[set->len] = '\0';
+
+	if (validate_rds(val->param, val->value, 0, NULL)) {
+		KMSG_ERRN("Invalid RDS set received.");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static struct pcimaxfm_request *pcimaxfm_rds_batch2_request(
+		struct pcimaxfm_dev *dev,
+		const struct pcimaxfm_rds_batch2 *batch)
+{
+	int i, ret;
+	struct pcimaxfm_request *req;
+
+	if (batch->count < 1 || batch->count > PCIMAXFM_RDS_BATCH_MAX)
+		return ERR_PTR(-EINVAL);
+
+	if ((req = pcimaxfm_request_alloc(PCIMAXFM_REQ_RDS, 0,
+					batch->count)) == NULL)
+		return ERR_PTR(-ENOMEM);
+
+	for (i = 0; i < batch->count; i++) {
+		if ((ret = pcimaxfm_rds_value2(dev, &batch->sets[i],
+						&req->rds[i]))) {
+			kfree(req);
+			return ERR_PTR(ret);
+		}
+	}
+
+	return req;
+}
+#endif /* PCIMAXFM_ENABLE_RDS */
+
+static void pcimaxfm_dev_free(struct kref *ref)
+{
+	struct pcimaxfm_dev *dev = container_of(ref, struct pcimaxfm_dev, ref);
+
+	/* Pages still mapped stay around until unmapped. */
+	vfree(dev->shm);
+#if PCIMAXFM_ENABLE_RDS
+	vfree(dev->rds_stage);
+#endif /* PCIMAXFM_ENABLE_RDS */
+	kfree(dev);
+}
+
+static struct pcimaxfm_dev *pcimaxfm_dev_get(unsigned int minor)
+{
+	struct pcimaxfm_dev *dev;
+
+	mutex_lock(&pcimaxfm_idr_lock);
+
+	if ((dev = idr_find(&pcimaxfm_idr, minor)) != NULL)
+		kref_get(&dev->ref);
+
+	mutex_unlock(&pcimaxfm_idr_lock);
+
+	return dev;
+}
+
+/* Card taking part in a broadcast. */
+struct pcimaxfm_target {
+	int status;
+	struct pcimaxfm_dev *dev;
+	struct pcimaxfm_request *req;
+};
+
+/* Request for a broadcast of one of the _SET ioctls taking an int. */
+static struct pcimaxfm_request *pcimaxfm_broadcast_request(unsigned int cmd,
+		int data)
+{
+	int type;
+	struct pcimaxfm_request *req;
+
+	switch (cmd) {
+#if PCIMAXFM_ENABLE_TX_TOGGLE
+		case PCIMAXFM_TX_SET:
+			type = PCIMAXFM_REQ_TX;
+			break;
+#endif /* PCIMAXFM_ENABLE_TX_TOGGLE */
+
+		case PCIMAXFM_FREQ_SET:
+			type = PCIMAXFM_REQ_FREQ;
+			break;
+
+		case PCIMAXFM_POWER_SET:
+			type = PCIMAXFM_REQ_POWER;
+			break;
+
+		case PCIMAXFM_STEREO_SET:
+			type = PCIMAXFM_REQ_STEREO;
+			break;
+
+#if PCIMAXFM_ENABLE_RDS
+#if PCIMAXFM_ENABLE_RDS_TOGGLE
+		case PCIMAXFM_RDSSIGNAL_SET:
+			type = PCIMAXFM_REQ_RDSSIGNAL;
+			break;
+#endif /* PCIMAXFM_ENABLE_RDS_TOGGLE */
+#endif /* PCIMAXFM_ENABLE_RDS */
+
+		default:
+			return ERR_PTR(-EINVAL);
+	}
+
+	if ((req = pcimaxfm_request_alloc(type, data, 0)) == NULL)
+		return ERR_PTR(-ENOMEM);
+
+	return req;
+}
+
+/* Queue a copy of tmpl on every card numbered in devs before collecting any
+ * result, so the per-card workers transfer in parallel. Any card but the
+ * caller's own needs CAP_DAC_OVERRIDE, whether or not it is open, and gets
+ * -EPERM otherwise. The result for each card is stored in status. Returns
+ * the first error of any card. */
+static int pcimaxfm_broadcast(struct pcimaxfm_client *client,
+		const struct pcimaxfm_request *tmpl, int count, const int *devs,
+		int *status)
+{
+	int i, ret = 0, values = 0;
+	int privileged = capable(CAP_DAC_OVERRIDE);
+	size_t size;
+	struct pcimaxfm_target *targets;
+
+#if PCIMAXFM_ENABLE_RDS
+	values = tmpl->count;
+#endif /* PCIMAXFM_ENABLE_RDS */
+	size = pcimaxfm_request_size(values);
+
+	if ((targets = kcalloc(count, sizeof(*targets), GFP_KERNEL)) == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < count; i++) {
+		struct pcimaxfm_target *t = &targets[i];
+
+		if ((t->dev = pcimaxfm_dev_get(devs[i])) == NULL) {
+			t->status = -ENODEV;
+			continue;
+		}
+
+		/* Other cards are reached without opening them, so whatever
+		 * their permissions, only the privileged may. */
+		if (t->dev != client->dev && !privileged) {
+			t->status = -EPERM;
+			continue;
+		}
+
+		if ((t->req = kmemdup(tmpl, size, GFP_KERNEL)) == NULL) {
+			t->status = -ENOMEM;
+			continue;
+		}
+
+		if ((t->status = pcimaxfm_queue_add(t->dev, NULL, t->req,
+						0)) < 0)
+			t->req = NULL;
+		else
+			t->status = 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		struct pcimaxfm_target *t = &targets[i];
+
+		if (t->req)
+			t->status = pcimaxfm_queue_wait(t->dev, t->req);
+
+		if (t->dev)
+			kref_put(&t->dev->ref, pcimaxfm_dev_free);
+
+		if (t->status && !ret)
+			ret = t->status;
+
+		status[i] = t->status;
+	}
+
+	kfree(targets);
+
+	return ret;
+}
+
+/* PCIMAXFM_BROADCAST, following the pointers in bc. */
+static int pcimaxfm_broadcast_user(struct pcimaxfm_client *client,
+		const struct pcimaxfm_broadcast *bc)
+{
+	int ret, *devs = NULL;
+	struct pcimaxfm_request *tmpl;
+#if PCIMAXFM_ENABLE_RDS
+	struct pcimaxfm_rds_batch batch;
+#endif /* PCIMAXFM_ENABLE_RDS */
+
+	if (bc->count < 1 || bc->count > PCIMAXFM_MAX_DEVS)
+		return -EINVAL;
+
+#if PCIMAXFM_ENABLE_RDS
+	if (bc->cmd == PCIMAXFM_RDS_SET_BATCH) {
+		if (copy_from_user(&batch,
+				(struct pcimaxfm_rds_batch __user *)bc->rds,
+				sizeof(batch)))
+			return -EFAULT;
+
+		tmpl = pcimaxfm_rds_batch_request(client->dev, &batch);
+	} else
+#endif /* PCIMAXFM_ENABLE_RDS */
+		tmpl = pcimaxfm_broadcast_request(bc->cmd, bc->data);
+
+	if (IS_ERR(tmpl))
+		return PTR_ERR(tmpl);
+
+	/* Card numbers followed by their results. */
+	if ((devs = kmalloc(2 * bc->count * sizeof(*devs), GFP_KERNEL)) == NULL) {
+		ret = -ENOMEM;
+		goto broadcast_done;
+	}
+
+	if (copy_from_user(devs, (int __user *)bc->devs,
+				bc->count * sizeof(*devs))) {
+		ret = -EFAULT;
+		goto broadcast_done;
+	}
+
+	ret = pcimaxfm_broadcast(client, tmpl, bc->count, devs,
+			devs + bc->count);
+
+	if (copy_to_user((int __user *)bc->status, devs + bc->count,
+				bc->count * sizeof(*devs)))
+		ret = -EFAULT;
+
+broadcast_done:
+	kfree(devs);
+	kfree(tmpl);
+
+	return ret;
+}
+
+/* PCIMAXFM_BROADCAST2, copied in whole and with only the results copied
+ * back. */
+static int pcimaxfm_broadcast2(struct pcimaxfm_client *client,
+		struct pcimaxfm_broadcast2 __user *ubc)
+{
+	int ret;
+	struct pcimaxfm_broadcast2 *bc;
+	struct pcimaxfm_request *tmpl;
+
+	if (IS_ERR(bc = memdup_user(ubc, sizeof(*bc))))
+		return PTR_ERR(bc);
+
+	if (bc->count < 1 || bc->count > PCIMAXFM_BROADCAST_MAX) {
+		ret = -EINVAL;
+		goto broadcast_done;
+	}
+
+#if PCIMAXFM_ENABLE_RDS
+	if (bc->cmd == PCIMAXFM_RDS_SET_BATCH2)
+		tmpl = pcimaxfm_rds_batch2_request(client->dev, &bc->rds);
+	else
+#endif /* PCIMAXFM_ENABLE_RDS */
+		tmpl = pcimaxfm_broadcast_request(bc->cmd, bc->data);
+
+	if (IS_ERR(tmpl)) {
+		ret = PTR_ERR(tmpl);
+		goto broadcast_done;
+	}
+
+	ret = pcimaxfm_broadcast(client, tmpl, bc->count, bc->devs,
+			bc->status);
+	kfree(tmpl);
+
+	if (copy_to_user(ubc->status, bc->status,
+				bc->count * sizeof(bc->status[0])))
+		ret = -EFAULT;
+
+broadcast_done:
+	kfree(bc);
+
+	return ret;
+}
+
+static int pcimaxfm_show(struct seq_file *m, void *v);
+
+static int pcimaxfm_open(struct inode *inode, struct file *filp)
+{
+	int ret = 0;
+	struct pcimaxfm_dev *dev;
+	struct pcimaxfm_client *client;
+
+	if ((dev = pcimaxfm_dev_get(iminor(inode))) == NULL)
+		return -ENODEV;
+
+	if ((client = kzalloc(sizeof(*client), GFP_KERNEL)) == NULL) {
+		kref_put(&dev->ref, pcimaxfm_dev_free);
+		return -ENOMEM;
+	}
+
+	client->dev = dev;
+
+	if ((ret = single_open(filp, pcimaxfm_show, client)))
+		goto open_failed;
+
+	/* Read-only opens are limited to queries and may be shared. */
+	if (!(filp->f_mode & FMODE_WRITE))
+		return 0;
+
+	spin_lock(&dev->use_lock);
+
+	if (dev->use_count && !capable(CAP_DAC_OVERRIDE))
+		ret = -EBUSY;
+	else
+		dev->use_count++;
+
+	spin_unlock(&dev->use_lock);
+
+	if (ret == 0)
+		return 0;
+
+	single_release(inode, filp);
+open_failed:
+	kfree(client);
+	kref_put(&dev->ref, pcimaxfm_dev_free);
+
+	return ret;
+}
+
+static int pcimaxfm_release(struct inode *inode, struct file *filp)
+{
+	struct pcimaxfm_client *client = pcimaxfm_client(filp);
+	struct pcimaxfm_dev *dev = client->dev;
+	struct pcimaxfm_request *req;
+	int lane;
+
+	/* Let pending requests complete without reporting back. */
+	spin_lock(&dev->queue_lock);
+
+	for (lane = 0; lane < PCIMAXFM_LANES; lane++) {
+		list_for_each_entry(req, &dev->lanes[lane], list) {
+			if (req->client == client)
+				req->client = NULL;
+		}
+	}
+
+	if (dev->active && dev->active->client == client)
+		dev->active->client = NULL;
+
+	spin_unlock(&dev->queue_lock);
+
+	if (filp->f_mode & FMODE_WRITE) {
+		spin_lock(&dev->use_lock);
+		dev->use_count--;
+		spin_unlock(&dev->use_lock);
+	}
+
+	single_release(inode, filp);
+	kfree(client);
+	kref_put(&dev->ref, pcimaxfm_dev_free);
+
+	return 0;
+}
+
+static unsigned int pcimaxfm_poll(struct file *filp, poll_table *wait)
+{
+	unsigned int mask = 0;
+	struct pcimaxfm_client *client = pcimaxfm_client(filp);
+	struct pcimaxfm_dev *dev = client->dev;
+
+	poll_wait(filp, &dev->queue_wait, wait);
+
+	spin_lock(&dev->queue_lock);
+
+	if (!pcimaxfm_seq_after(client->seq, dev->done_seq))
+		mask |= POLLIN | POLLRDNORM;
+
+	if (dev->queue_len < PCIMAXFM_QUEUE_DEPTH)
+		mask |= POLLOUT | POLLWRNORM;
+
+	if (client->error)
+		mask |= POLLERR;
+
+	spin_unlock(&dev->queue_lock);
+
+	return mask;
+}
+
+static void pcimaxfm_show_text(struct seq_file *m, struct pcimaxfm_dev *dev,
+		const struct pcimaxfm_status *st)
+{
+	if (st->flags & PCIMAXFM_STATUS_TX)
+		seq_printf(m, "TX      : %s\n", PCIMAXFM_STR_BOOL(st->tx));
+
+	if (st->freq == PCIMAXFM_FREQ_NA) {
+		seq_puts(m, "Freq    : NA\n");
+	} else {
+		seq_printf(m, "Freq    : %u.%u%u MHz (%u 50 KHz steps)\n",
+				st->freq / 20,
+				(st->freq % 20) / 2,
+				(st->freq % 2 == 0 ? 0 : 5),
+				st->freq);
+	}
+
+	if (st->power == PCIMAXFM_POWER_NA) {
+		seq_printf(m, "Power   : NA/%u\n", PCIMAXFM_POWER_MAX);
+	} else {
+		seq_printf(m, "Power   : %u/%u\n", st->power,
+				PCIMAXFM_POWER_MAX);
+	}
+
+	seq_printf(m, "Stereo  : %s\n", PCIMAXFM_STR_BOOL(st->stereo));
+
+	if (st->flags & PCIMAXFM_STATUS_RDSSIGNAL)
+		seq_printf(m, "RDS     : %s\n",
+				PCIMAXFM_STR_BOOL(st->rdssignal));
+
+	seq_printf(m,
+			"\n"
+			"Version : %s\n"
+			"Address : %#lx\n"
+			"Control : %#x\n"
+			"Data    : %#x\n",
+			dev->card->version, dev->base_addr,
+			st->io_ctrl, st->io_data);
+}
+
+/* The keys of write(), with settings never made left out, followed by the
+ * card details and every RDS parameter that has been set. */
+static void pcimaxfm_show_keyval(struct seq_file *m, struct pcimaxfm_dev *dev,
+		const struct pcimaxfm_status *st)
+{
+#if PCIMAXFM_ENABLE_RDS
+	int i;
+#endif /* PCIMAXFM_ENABLE_RDS */
+
+	if (st->flags & PCIMAXFM_STATUS_TX)
+		seq_printf(m, "TX=%d\n", st->tx);
+	if (st->freq != PCIMAXFM_FREQ_NA)
+		seq_printf(m, "FREQ=%d\n", st->freq);
+	if (st->power != PCIMAXFM_POWER_NA)
+		seq_printf(m, "POWER=%d\n", st->power);
+	seq_printf(m, "STEREO=%d\n", st->stereo);
+	if ((st->flags & PCIMAXFM_STATUS_RDSSIGNAL) &&
+			st->rdssignal != PCIMAXFM_BOOL_NA)
+		seq_printf(m, "RDSSIGNAL=%d\n", st->rdssignal);
+
+	seq_printf(m, "VERSION=%s\nADDRESS=%#lx\nCONTROL=%#x\nDATA=%#x\n",
+			dev->card->version, dev->base_addr,
+			st->io_ctrl, st->io_data);
+
+#if PCIMAXFM_ENABLE_RDS
+	if (st->flags & PCIMAXFM_STATUS_RDS) {
+		for (i = 0; i < RDS_PARAM_END; i++) {
+			if (st->rds[i][0] != '\0')
+				seq_printf(m, "%s=%s\n", rds_params_name[i],
+						st->rds[i]);
+		}
+	}
+#endif /* PCIMAXFM_ENABLE_RDS */
+}
+
+static void pcimaxfm_show_json_int(struct seq_file *m, const char *key,
+		int val, int na)
+{
+	if (val == na)
+		seq_printf(m, ",\"%s\":null", key);
+	else
+		seq_printf(m, ",\"%s\":%d", key, val);
+}
+
+/* RDS values are not necessarily ASCII, so anything outside printable ASCII
+ * is escaped as the Latin-1 code point. */
+static void pcimaxfm_show_json_str(struct seq_file *m, const char *str)
+{
+	unsigned char c;
+
+	seq_putc(m, '"');
+
+	for (; (c = *str) != '\0'; str++) {
+		if (c == '"' || c == '\\')
+			seq_printf(m, "\\%c", c);
+		else if (c < 0x20 || c > 0x7e)
+			seq_printf(m, "\\u%04x", c);
+		else
+			seq_putc(m, c);
+	}
+
+	seq_putc(m, '"');
+}
+
+/* One object on one line. Settings never made are null, features the card
+ * lacks are left out. */
+static void pcimaxfm_show_json(struct seq_file *m, struct pcimaxfm_dev *dev,
+		const struct pcimaxfm_status *st)
+{
+#if PCIMAXFM_ENABLE_RDS
+	int i, first = 1;
+#endif /* PCIMAXFM_ENABLE_RDS */
+
+	seq_puts(m, "{\"version\":");
+	pcimaxfm_show_json_str(m, dev->card->version);
+	seq_printf(m, ",\"address\":%lu,\"control\":%d,\"data\":%d",
+			dev->base_addr, st->io_ctrl, st->io_data);
+
+	if (st->flags & PCIMAXFM_STATUS_TX)
+		pcimaxfm_show_json_int(m, "tx", st->tx, PCIMAXFM_BOOL_NA);
+	pcimaxfm_show_json_int(m, "freq", st->freq, PCIMAXFM_FREQ_NA);
+	pcimaxfm_show_json_int(m, "power", st->power, PCIMAXFM_POWER_NA);
+	pcimaxfm_show_json_int(m, "stereo", st->stereo, PCIMAXFM_BOOL_NA);
+	if (st->flags & PCIMAXFM_STATUS_RDSSIGNAL)
+		pcimaxfm_show_json_int(m, "rdssignal", st->rdssignal,
+				PCIMAXFM_BOOL_NA);
+
+#if PCIMAXFM_ENABLE_RDS
+	if (st->flags & PCIMAXFM_STATUS_RDS) {
+		seq_puts(m, ",\"rds\":{");
+
+		for (i = 0; i < RDS_PARAM_END; i++) {
+			if (st->rds[i][0] == '\0')
+				continue;
+
+			seq_printf(m, "%s\"%s\":", first ? "" : ",",
+					rds_params_name[i]);
+			pcimaxfm_show_json_str(m, st->rds[i]);
+			first = 0;
+		}
+
+		seq_putc(m, '}');
+	}
+#endif /* PCIMAXFM_ENABLE_RDS */
+
+	seq_puts(m, "}\n");
+}
+
+/* read() goes through seq_file, formatting one snapshot per pass from
+ * offset 0 in the format chosen with PCIMAXFM_FORMAT_SET. */
+static int pcimaxfm_show(struct seq_file *m, void *v)
+{
+	struct pcimaxfm_client *client = m->private;
+	struct pcimaxfm_dev *dev = client->dev;
+	struct pcimaxfm_status *st;
+
+	if ((st = kmalloc(sizeof(*st), GFP_KERNEL)) == NULL)
+		return -ENOMEM;
+
+	pcimaxfm_status_get(dev, st);
+
+	switch (READ_ONCE(client->format)) {
+		case PCIMAXFM_FORMAT_KEYVAL:
+			pcimaxfm_show_keyval(m, dev, st);
+			break;
+		case PCIMAXFM_FORMAT_JSON:
+			pcimaxfm_show_json(m, dev, st);
+			break;
+		default:
+			pcimaxfm_show_text(m, dev, st);
+			break;
+	}
+
+	kfree(st);
+
+	return 0;
+}
+
+/* Keys accepted by write() besides the RDS parameter names. */
+static const char *pcimaxfm_write_keys[] = {
+#if PCIMAXFM_ENABLE_TX_TOGGLE
+	[PCIMAXFM_REQ_TX]        = "TX",
+#endif /* PCIMAXFM_ENABLE_TX_TOGGLE */
+	[PCIMAXFM_REQ_FREQ]      = "FREQ",
+	[PCIMAXFM_REQ_POWER]     = "POWER",
+	[PCIMAXFM_REQ_STEREO]    = "STEREO",
+#if PCIMAXFM_ENABLE_RDS_TOGGLE
+	[PCIMAXFM_REQ_RDSSIGNAL] = "RDSSIGNAL"
+#endif /* PCIMAXFM_ENABLE_RDS_TOGGLE */
+};
+
+/* Parse one "KEY=VALUE" line in place. Consecutive RDS parameters are
+ * collected in *batch, anything else becomes a request of its own. Returns
+ * 1 if the line was added to the batch, 0 if *req was set. */
+static int pcimaxfm_write_parse(char *line,
+		struct pcimaxfm_request **batch, struct pcimaxfm_request **req)
+{
+	int i, data;
+	char *val;
+
+	if ((val = strchr(line, '=')) == NULL)
+		return -EINVAL;
+
+	*val++ = '\0';
+
+#if PCIMAXFM_ENABLE_RDS
+	for (i = 0; i < RDS_PARAM_END; i++) {
+		if (strcmp(line, rds_params_name[i]))
+			continue;
+
+		if (strlen(val) > PCIMAXFM_RDS_VALUE_MAX ||
+				validate_rds(i, val, 0, NULL))
+			return -EINVAL;
+
+		if (*batch == NULL && (*batch = pcimaxfm_request_alloc(
+					PCIMAXFM_REQ_RDS, 0,
+					PCIMAXFM_RDS_BATCH_MAX)) == NULL)
+			return -ENOMEM;
+
+		(*batch)->rds[(*batch)->count].param = i;
+		strlcpy((*batch)->rds[(*batch)->count].value, val,
+				sizeof((*batch)->rds[0].value));
+		(*batch)->count++;
+
+		return 1;
+	}
+#endif /* PCIMAXFM_ENABLE_RDS */
+
+	for (i = 0; i < ARRAY_SIZE(pcimaxfm_write_keys); i++) {
+		if (pcimaxfm_write_keys[i] == NULL ||
+				strcmp(line, pcimaxfm_write_keys[i]))
+			continue;
+
+		if (kstrtoint(val, 10, &data))
+			return -EINVAL;
+
+		if ((*req = pcimaxfm_request_alloc(i, data, 0)) == NULL)
+			return -ENOMEM;
+
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
+/* Apply the "KEY=VALUE" lines of a terminated buffer in order, skipping
+ * blank lines and comments. Only lines ending in a newline count, a partial
+ * line after the last one is left alone. Stops at the first line that can't
+ * be parsed or queued and returns the length of the lines before it, if
+ * any. */
+static ssize_t pcimaxfm_apply(struct pcimaxfm_dev *dev,
+		struct pcimaxfm_client *client, char *buf, size_t count,
+		int nonblock)
+{
+	int ret = 0;
+	size_t pos = 0, done = 0, batch_end = 0;
+	char *line, *nl;
+	struct pcimaxfm_request *batch = NULL, *req = NULL;
+
+	while (count > 0 && buf[count - 1] != '\n')
+		count--;
+
+	if (count == 0)
+		return -EINVAL;
+
+	while (pos < count) {
+		line = buf + pos;
+		nl = memchr(line, '\n', count - pos);
+		*nl = '\0';
+		pos = nl - buf + 1;
+
+		if ((nl = strchr(line, '\r')) != NULL)
+			*nl = '\0';
+
+		if (*line == '\0' || *line == '#') {
+			if (batch != NULL)
+				batch_end = pos;
+			else
+				done = pos;
+			continue;
+		}
+
+		if ((ret = pcimaxfm_write_parse(line, &batch, &req)) < 0)
+			break;
+
+		if (ret == 1) {
+			batch_end = pos;
+#if PCIMAXFM_ENABLE_RDS
+			if (batch->count < PCIMAXFM_RDS_BATCH_MAX)
+				continue;
+#endif /* PCIMAXFM_ENABLE_RDS */
+		}
+
+		if (batch != NULL) {
+			ret = pcimaxfm_queue_submit(dev, client, batch,
+					nonblock);
+			batch = NULL;
+
+			if (ret < 0) {
+				kfree(req);
+				break;
+			}
+
+			done = batch_end;
+		}
+
+		if (req != NULL) {
+			ret = pcimaxfm_queue_submit(dev, client, req,
+					nonblock);
+			req = NULL;
+
+			if (ret < 0)
+				break;
+
+			done = pos;
+		}
+
+		ret = 0;
+	}
+
+	/* Lines before a bad one still go out. */
+	if (batch != NULL) {
+		int err = pcimaxfm_queue_submit(dev, client, batch, nonblock);
+
+		if (err >= 0)
+			done = batch_end;
+		else if (ret >= 0)
+			ret = err;
+	}
+
+	if (done > 0)
+		return done;
+
+	return ret;
+}
+
+static ssize_t pcimaxfm_write(struct file *filp, const char __user *ubuf,
+		size_t count, loff_t *f_pos)
+{
+	struct pcimaxfm_client *client = pcimaxfm_client(filp);
+	ssize_t ret;
+	char *buf;
+
+	/* The rest is left for the next call, after the last complete
+	 * line. */
+	count = min_t(size_t, count, PCIMAXFM_WRITE_MAX);
+
+	if (count == 0)
+		return 0;
+
+	if ((buf = kmalloc(count + 1, GFP_KERNEL)) == NULL)
+		return -ENOMEM;
+
+	if (copy_from_user(buf, ubuf, count)) {
+		kfree(buf);
+		return -EFAULT;
+	}
+
+	buf[count] = '\0';
+
+	ret = pcimaxfm_apply(client->dev, client, buf, count,
+			filp->f_flags & O_NONBLOCK);
+
+	kfree(buf);
+
+	return ret;
+}
+
+/* Commands that change the card or drive the bus, refused on read-only
+ * opens. */
+static int pcimaxfm_ioctl_writes(unsigned int cmd)
+{
+	switch (cmd) {
+#if PCIMAXFM_ENABLE_TX_TOGGLE
+		case PCIMAXFM_TX_SET:
+#endif /* PCIMAXFM_ENABLE_TX_TOGGLE */
+		case PCIMAXFM_FREQ_SET:
+		case PCIMAXFM_POWER_SET:
+		case PCIMAXFM_STEREO_SET:
+#if PCIMAXFM_ENABLE_RDS
+#if PCIMAXFM_ENABLE_RDS_TOGGLE
+		case PCIMAXFM_RDSSIGNAL_SET:
+#endif /* PCIMAXFM_ENABLE_RDS_TOGGLE */
+		case PCIMAXFM_RDS_SET:
+		case PCIMAXFM_RDS_SET_BATCH:
+		case PCIMAXFM_RDS_SET2:
+		case PCIMAXFM_RDS_SET_BATCH2:
+		case PCIMAXFM_RDS_COMMIT:
+#endif /* PCIMAXFM_ENABLE_RDS */
+		case PCIMAXFM_PING:
+		case PCIMAXFM_BROADCAST:
+		case PCIMAXFM_BROADCAST2:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+/* Features a command needs from the card. */
+static unsigned int pcimaxfm_ioctl_caps(unsigned int cmd)
+{
+	switch (cmd) {
+#if PCIMAXFM_ENABLE_TX_TOGGLE
+		case PCIMAXFM_TX_SET:
+		case PCIMAXFM_TX_GET:
+			return PCIMAXFM_CAP_TX;
+#endif /* PCIMAXFM_ENABLE_TX_TOGGLE */
+#if PCIMAXFM_ENABLE_RDS
+#if PCIMAXFM_ENABLE_RDS_TOGGLE
+		case PCIMAXFM_RDSSIGNAL_SET:
+		case PCIMAXFM_RDSSIGNAL_GET:
+			return PCIMAXFM_CAP_RDSSIGNAL;
+#endif /* PCIMAXFM_ENABLE_RDS_TOGGLE */
+		case PCIMAXFM_RDS_SET:
+		case PCIMAXFM_RDS_SET_BATCH:
+		case PCIMAXFM_RDS_GET:
+		case PCIMAXFM_RDS_SET2:
+		case PCIMAXFM_RDS_SET_BATCH2:
+		case PCIMAXFM_RDS_COMMIT:
+			return PCIMAXFM_CAP_RDS;
+#endif /* PCIMAXFM_ENABLE_RDS */
+		default:
+			return 0;
+	}
+}
+
+static long pcimaxfm_do_ioctl(struct file *filp, unsigned int cmd,
+		unsigned long arg)
+{
+	int data, ret = 0;
+	struct pcimaxfm_client *client = pcimaxfm_client(filp);
+	struct pcimaxfm_dev *dev = client->dev;
+	struct pcimaxfm_queue_status status;
+	struct pcimaxfm_state state;
+	struct pcimaxfm_broadcast bc;
+	struct pcimaxfm_status *st;
+#if PCIMAXFM_ENABLE_RDS
+	unsigned int seq;
+	struct pcimaxfm_request *req;
+	struct pcimaxfm_rds_set rds;
+	struct pcimaxfm_rds_batch batch;
+	struct pcimaxfm_rds_get rds_get;
+	struct pcimaxfm_rds_set2 rds2;
+	struct pcimaxfm_rds_batch2 *batch2;
+#endif /* PCIMAXFM_ENABLE_RDS */
+
+	if (_IOC_TYPE(cmd) == PCIMAXFM_IOC_MAGIC &&
+			_IOC_NR(cmd) < PCIMAXFM_STATS_IOCTLS)
+		atomic_long_inc(&dev->stats.ioctls[_IOC_NR(cmd)]);
+
+	if (!(filp->f_mode & FMODE_WRITE) && pcimaxfm_ioctl_writes(cmd))
+		return -EBADF;
+
+	if (!pcimaxfm_has(dev, pcimaxfm_ioctl_caps(cmd)))
+		return -ENOTTY;
+
+	switch (cmd) {
+#if PCIMAXFM_ENABLE_TX_TOGGLE
+		case PCIMAXFM_TX_SET:
+			if (get_user(data, (int __user *)arg))
+				return -1;
+
+			ret = pcimaxfm_submit(filp, pcimaxfm_request_alloc(
+						PCIMAXFM_REQ_TX, data, 0));
+			break;
+
+		case PCIMAXFM_TX_GET:
+			pcimaxfm_state_read(dev, &state);
+
+			if (put_user(pcimaxfm_tx_get(&state),
+						(int __user *)arg))
+				return -1;
+
+			break;
+#endif /* PCIMAXFM_ENABLE_TX_TOGGLE */
+
+		case PCIMAXFM_FREQ_SET:
+			if (get_user(data, (int __user *)arg))
+				return -1;
+
+			ret = pcimaxfm_submit(filp, pcimaxfm_request_alloc(
+						PCIMAXFM_REQ_FREQ, data, 0));
+			break;
+
+		case PCIMAXFM_FREQ_GET:
+			pcimaxfm_state_read(dev, &state);
+
+			if (put_user(state.freq, (int __user *)arg))
+				return -1;
+			break;
+
+		case PCIMAXFM_POWER_SET:
+			if (get_user(data, (int __user *)arg))
+				return -1;
+
+			ret = pcimaxfm_submit(filp, pcimaxfm_request_alloc(
+						PCIMAXFM_REQ_POWER, data, 0));
+			break;
+
+		case PCIMAXFM_POWER_GET:
+			pcimaxfm_state_read(dev, &state);
+
+			if (put_user(state.power, (int __user *)arg))
+				return -1;
+
+			break;
+
+		case PCIMAXFM_STEREO_SET:
+			if (get_user(data, (int __user *)arg))
+				return -1;
+
+			ret = pcimaxfm_submit(filp, pcimaxfm_request_alloc(
+						PCIMAXFM_REQ_STEREO, data, 0));
+			break;
+
+		case PCIMAXFM_STEREO_GET:
+			pcimaxfm_state_read(dev, &state);
+
+			if (put_user(pcimaxfm_stereo_get(dev, &state),
+						(int __user *)arg))
+				return -1;
+
+			break;
+
+#if PCIMAXFM_ENABLE_RDS
+#if PCIMAXFM_ENABLE_RDS_TOGGLE
+		case PCIMAXFM_RDSSIGNAL_SET:
+			if (get_user(data, (int __user *)arg))
+				return -1;
+
+			ret = pcimaxfm_submit(filp, pcimaxfm_request_alloc(
+						PCIMAXFM_REQ_RDSSIGNAL, data, 0));
+			break;
+
+		case PCIMAXFM_RDSSIGNAL_GET:
+			pcimaxfm_state_read(dev, &state);
+
+			if (put_user(state.rdssignal, (int __user *)arg))
+				return -1;
+
+			break;
+#endif /* PCIMAXFM_ENABLE_RDS_TOGGLE */
+
+		case PCIMAXFM_RDS_SET:
+			if(copy_from_user(&rds,
+					(struct pcimaxfm_rds_set __user *)arg,
+					sizeof(rds)) != 0)
+				return -1;
+
+			if ((req = pcimaxfm_request_alloc(
+					PCIMAXFM_REQ_RDS, 0, 1)) == NULL)
+				return -ENOMEM;
+
+			req->rds[0].param = rds.param;
+
+			if ((ret = pcimaxfm_rds_copy_value(dev, rds.param,
+					(const char __user *)rds.value,
+					req->rds[0].value))) {
+				kfree(req);
+				return ret;
+			}
+
+			ret = pcimaxfm_submit(filp, req);
+			break;
+
+		case PCIMAXFM_RDS_GET:
+			if (get_user(rds_get.param, (int __user *)arg))
+				return -EFAULT;
+
+			if (rds_get.param < 0 || rds_get.param >= RDS_PARAM_END)
+				return -EINVAL;
+
+			do {
+				seq = read_seqcount_begin(&dev->state_seq);
+				rds_get.dirty = test_bit(rds_get.param,
+						dev->rds_dirty);
+				memcpy(rds_get.value, dev->rds[rds_get.param],
+						sizeof(rds_get.value));
+			} while (read_seqcount_retry(&dev->state_seq, seq));
+
+			if (copy_to_user((struct pcimaxfm_rds_get __user *)arg,
+					&rds_get, sizeof(rds_get)))
+				return -EFAULT;
+
+			break;
+
+		case PCIMAXFM_RDS_SET_BATCH:
+			if (copy_from_user(&batch,
+					(struct pcimaxfm_rds_batch __user *)arg,
+					sizeof(batch)) != 0)
+				return -EFAULT;
+
+			req = pcimaxfm_rds_batch_request(dev, &batch);
+
+			if (IS_ERR(req))
+				return PTR_ERR(req);
+
+			ret = pcimaxfm_submit(filp, req);
+			break;
+
+		case PCIMAXFM_RDS_SET2:
+			if (copy_from_user(&rds2,
+					(struct pcimaxfm_rds_set2 __user *)arg,
+					sizeof(rds2)))
+				return -EFAULT;
+
+			if ((req = pcimaxfm_request_alloc(
+					PCIMAXFM_REQ_RDS, 0, 1)) == NULL)
+				return -ENOMEM;
+
+			if ((ret = pcimaxfm_rds_value2(dev, &rds2,
+							&req->rds[0]))) {
+				kfree(req);
+				return ret;
+			}
+
+			ret = pcimaxfm_submit(filp, req);
+			break;
+
+		case PCIMAXFM_RDS_SET_BATCH2:
+			batch2 = memdup_user(
+					(struct pcimaxfm_rds_batch2 __user *)arg,
+					sizeof(*batch2));
+
+			if (IS_ERR(batch2))
+				return PTR_ERR(batch2);
+
+			req = pcimaxfm_rds_batch2_request(dev, batch2);
+			kfree(batch2);
+
+			if (IS_ERR(req))
+				return PTR_ERR(req);
+
+			ret = pcimaxfm_submit(filp, req);
+			break;
+
+		case PCIMAXFM_RDS_COMMIT:
+			if ((req = pcimaxfm_rds_commit_request(dev)) == NULL)
+				break;
+
+			if (IS_ERR(req))
+				return PTR_ERR(req);
+
+			ret = pcimaxfm_submit(filp, req);
+			break;
+#endif /* PCIMAXFM_ENABLE_RDS */
+
+		case PCIMAXFM_PING:
+			if (get_user(data, (int __user *)arg))
+				return -EFAULT;
+
+			if (data != PCIMAXFM_I2C_ADDR_PLL
+#if PCIMAXFM_ENABLE_RDS
+					&& data != PCIMAXFM_I2C_ADDR_RDS
+#endif /* PCIMAXFM_ENABLE_RDS */
+					)
+				return -EINVAL;
+
+			ret = pcimaxfm_submit(filp, pcimaxfm_request_alloc(
+						PCIMAXFM_REQ_PING, data, 0));
+			break;
+
+		case PCIMAXFM_FENCE:
+			if (get_user(data, (int __user *)arg))
+				return -EFAULT;
+
+			ret = pcimaxfm_queue_fence(filp, data);
+			break;
+
+		case PCIMAXFM_QUEUE_STATUS:
+			pcimaxfm_queue_status(client, &status);
+
+			if (copy_to_user(
+					(struct pcimaxfm_queue_status __user *)arg,
+					&status, sizeof(status)))
+				return -EFAULT;
+
+			break;
+
+		case PCIMAXFM_BROADCAST:
+			if (copy_from_user(&bc,
+					(struct pcimaxfm_broadcast __user *)arg,
+					sizeof(bc)))
+				return -EFAULT;
+
+			ret = pcimaxfm_broadcast_user(client, &bc);
+			break;
+
+		case PCIMAXFM_BROADCAST2:
+			ret = pcimaxfm_broadcast2(client,
+					(struct pcimaxfm_broadcast2 __user *)arg);
+			break;
+
+		case PCIMAXFM_STATUS_GET:
+			if (get_user(data, (int __user *)arg))
+				return -EFAULT;
+
+			if (data != PCIMAXFM_STATUS_VERSION)
+				return -EINVAL;
+
+			if ((st = kmalloc(sizeof(*st), GFP_KERNEL)) == NULL)
+				return -ENOMEM;
+
+			pcimaxfm_status_get(dev, st);
+
+			if (copy_to_user((struct pcimaxfm_status __user *)arg,
+					st, sizeof(*st)))
+				ret = -EFAULT;
+
+			kfree(st);
+			break;
+
+		case PCIMAXFM_FORMAT_SET:
+			if (get_user(data, (int __user *)arg))
+				return -EFAULT;
+
+			if (data < PCIMAXFM_FORMAT_TEXT ||
+					data > PCIMAXFM_FORMAT_JSON)
+				return -EINVAL;
+
+			WRITE_ONCE(client->format, data);
+			break;
+
+		default:
+			return -ENOTTY;
+	}
+
+	return ret;
+}
+
+static long pcimaxfm_ioctl(struct file *filp, unsigned int cmd,
+		unsigned long arg)
+{
+	long ret;
+	struct pcimaxfm_client *client = pcimaxfm_client(filp);
+
+	trace_pcimaxfm_ioctl_enter(client->dev->dev_num, cmd);
+	ret = pcimaxfm_do_ioctl(filp, cmd, arg);
+	trace_pcimaxfm_ioctl_exit(client->dev->dev_num, cmd, ret);
+
+	return ret;
+}
+
+#ifdef CONFIG_COMPAT
+/* Every ioctl but the version 1 RDS sets and broadcast has the same layout
+ * for 32-bit callers. Those carry pointers, which changes their numbers, and
+ * are refused, the version 2 ioctls doing the same. */
+static long pcimaxfm_compat_ioctl(struct file *filp, unsigned int cmd,
+		unsigned long arg)
+{
+	switch (cmd) {
+#if PCIMAXFM_ENABLE_RDS
+		case _IOR(PCIMAXFM_IOC_MAGIC, _IOC_NR(PCIMAXFM_RDS_SET),
+				compat_uptr_t):
+		case _IOR(PCIMAXFM_IOC_MAGIC, _IOC_NR(PCIMAXFM_RDS_SET_BATCH),
+				compat_uptr_t):
+#endif /* PCIMAXFM_ENABLE_RDS */
+		case _IOR(PCIMAXFM_IOC_MAGIC, _IOC_NR(PCIMAXFM_BROADCAST),
+				compat_uptr_t):
+			KMSG_DEBUG("Version 1 ioctl %u from a 32-bit caller, "
+					"use version 2.", _IOC_NR(cmd));
+			return -ENOTTY;
+	}
+
+	return pcimaxfm_ioctl(filp, cmd, (unsigned long)compat_ptr(arg));
+}
+#endif /* CONFIG_COMPAT */
+
+/* The status page at offset 0 may only be mapped read-only, the RDS staging
+ * area at PCIMAXFM_MMAP_STAGE only through files open for writing. */
+static int pcimaxfm_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct pcimaxfm_client *client = pcimaxfm_client(filp);
+	struct pcimaxfm_dev *dev = client->dev;
+
+	if (vma->vm_pgoff == 0) {
+		if (vma->vm_flags & VM_WRITE)
+			return -EPERM;
+
+		vma->vm_flags &= ~VM_MAYWRITE;
+
+		return remap_vmalloc_range(vma, dev->shm, 0);
+	}
+
+#if PCIMAXFM_ENABLE_RDS
+	if (vma->vm_pgoff == PCIMAXFM_MMAP_STAGE >> PAGE_SHIFT) {
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EACCES;
+
+		if (!pcimaxfm_has(dev, PCIMAXFM_CAP_RDS))
+			return -ENODEV;
+
+		return remap_vmalloc_range(vma, dev->rds_stage, 0);
+	}
+#endif /* PCIMAXFM_ENABLE_RDS */
+
+	return -EINVAL;
+}
+
+static struct file_operations pcimaxfm_fops = {
+	.owner          = THIS_MODULE,
+	.read           = seq_read,
+	.llseek         = seq_lseek,
+	.write          = pcimaxfm_write,
+	.unlocked_ioctl = pcimaxfm_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl   = pcimaxfm_compat_ioctl,
+#endif /* CONFIG_COMPAT */
+	.poll           = pcimaxfm_poll,
+	.mmap           = pcimaxfm_mmap,
+	.open           = pcimaxfm_open,
+	.release        = pcimaxfm_release
+};
+
+static ssize_t i2c_profile_show(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	struct pcimaxfm_dev *dev = dev_get_drvdata(d);
+
+	return snprintf(buf, PAGE_SIZE, "%s\n",
+			pcimaxfm_i2c_profile_name[dev->i2c_profile]);
+}
+
+static ssize_t i2c_profile_store(struct device *d,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct pcimaxfm_dev *dev = dev_get_drvdata(d);
+	int i;
+
+	for (i = 0; i < PCIMAXFM_I2C_PROFILE_END; i++) {
+		if (sysfs_streq(buf, pcimaxfm_i2c_profile_name[i])) {
+			if (mutex_lock_interruptible(&dev->bus_lock))
+				return -ERESTARTSYS;
+
+			dev->i2c_profile = i;
+			dev->i2c.timing = pcimaxfm_i2c_profiles[i];
+			mutex_unlock(&dev->bus_lock);
+			return count;
+		}
+	}
+
+	return -EINVAL;
+}
+
+static DEVICE_ATTR(i2c_profile, 0644, i2c_profile_show, i2c_profile_store);
+
+/* Timing knobs. Changing any of them switches the device to a custom
+ * profile based on its current timing. */
+#define PCIMAXFM_I2C_TIMING_ATTR(field) \
+static ssize_t i2c_##field##_us_show(struct device *d, \
+		struct device_attribute *attr, char *buf) \
+{ \
+	struct pcimaxfm_dev *dev = dev_get_drvdata(d); \
+\
+	return snprintf(buf, PAGE_SIZE, "%u\n", dev->i2c.timing.field); \
+} \
+\
+static ssize_t i2c_##field##_us_store(struct device *d, \
+		struct device_attribute *attr, const char *buf, size_t count) \
+{ \
+	struct pcimaxfm_dev *dev = dev_get_drvdata(d); \
+	unsigned int usecs; \
+\
+	if (kstrtouint(buf, 0, &usecs) || usecs < 1 || \
+			usecs > PCIMAXFM_I2C_DELAY_MAX_USECS) \
+		return -EINVAL; \
+\
+	if (mutex_lock_interruptible(&dev->bus_lock)) \
+		return -ERESTARTSYS; \
+\
+	dev->i2c.timing.field = usecs; \
+	dev->i2c_profile = PCIMAXFM_I2C_CUSTOM; \
+	mutex_unlock(&dev->bus_lock); \
+\
+	return count; \
+} \
+\
+static DEVICE_ATTR(i2c_##field##_us, 0644, \
+		i2c_##field##_us_show, i2c_##field##_us_store)
+
+PCIMAXFM_I2C_TIMING_ATTR(setup);
+PCIMAXFM_I2C_TIMING_ATTR(hold);
+PCIMAXFM_I2C_TIMING_ATTR(high);
+PCIMAXFM_I2C_TIMING_ATTR(low);
+
+static ssize_t i2c_retries_show(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	struct pcimaxfm_dev *dev = dev_get_drvdata(d);
+
+	return snprintf(buf, PAGE_SIZE, "%u\n", dev->i2c.retries);
+}
+
+static ssize_t i2c_retries_store(struct device *d,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct pcimaxfm_dev *dev = dev_get_drvdata(d);
+	unsigned int retries;
+
+	if (kstrtouint(buf, 0, &retries) || retries > PCIMAXFM_I2C_RETRIES_MAX)
+		return -EINVAL;
+
+	dev->i2c.retries = retries;
+
+	return count;
+}
+
+static DEVICE_ATTR(i2c_retries, 0644, i2c_retries_show, i2c_retries_store);
+
+static int pcimaxfm_attr_submit(struct pcimaxfm_dev *dev,
+		struct pcimaxfm_request *req)
+{
+	if (req == NULL)
+		return -ENOMEM;
+
+	return pcimaxfm_queue_submit(dev, NULL, req, 0);
+}
+
+static ssize_t i2c_calibrate_store(struct device *d,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct pcimaxfm_dev *dev = dev_get_drvdata(d);
+	int ret;
+
+	if ((ret = pcimaxfm_attr_submit(dev, pcimaxfm_request_alloc(
+					PCIMAXFM_REQ_CALIBRATE, 0, 0))))
+		return ret;
+
+	return count;
+}
+
+static DEVICE_ATTR(i2c_calibrate, 0200, NULL, i2c_calibrate_store);
+
+/* Settings read from the published state and written through the queue like
+ * their ioctls. */
+#define PCIMAXFM_STATE_ATTR(name, type, value) \
+static ssize_t name##_show(struct device *d, \
+		struct device_attribute *attr, char *buf) \
+{ \
+	struct pcimaxfm_dev *dev = dev_get_drvdata(d); \
+	struct pcimaxfm_state state; \
+\
+	pcimaxfm_state_read(dev, &state); \
+\
+	return snprintf(buf, PAGE_SIZE, "%d\n", (int)(value)); \
+} \
+\
+static ssize_t name##_store(struct device *d, \
+		struct device_attribute *attr, const char *buf, size_t count) \
+{ \
+	struct pcimaxfm_dev *dev = dev_get_drvdata(d); \
+	int data, ret; \
+\
+	if (kstrtoint(buf, 0, &data)) \
+		return -EINVAL; \
+\
+	if ((ret = pcimaxfm_attr_submit(dev, \
+				pcimaxfm_request_alloc(type, data, 0)))) \
+		return ret; \
+\
+	return count; \
+} \
+\
+static DEVICE_ATTR(name, 0644, name##_show, name##_store)
+
+#if PCIMAXFM_ENABLE_TX_TOGGLE
+PCIMAXFM_STATE_ATTR(tx, PCIMAXFM_REQ_TX, pcimaxfm_tx_get(&state));
+#endif /* PCIMAXFM_ENABLE_TX_TOGGLE */
+PCIMAXFM_STATE_ATTR(freq, PCIMAXFM_REQ_FREQ, state.freq);
+PCIMAXFM_STATE_ATTR(power, PCIMAXFM_REQ_POWER, state.power);
+PCIMAXFM_STATE_ATTR(stereo, PCIMAXFM_REQ_STEREO,
+		pcimaxfm_stereo_get(dev, &state));
+#if PCIMAXFM_ENABLE_RDS_TOGGLE
+PCIMAXFM_STATE_ATTR(rdssignal, PCIMAXFM_REQ_RDSSIGNAL, state.rdssignal);
+#endif /* PCIMAXFM_ENABLE_RDS_TOGGLE */
+
+static ssize_t version_show(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	struct pcimaxfm_dev *dev = dev_get_drvdata(d);
+
+	return snprintf(buf, PAGE_SIZE, "%s\n", dev->card->version);
+}
+
+static DEVICE_ATTR(version, 0444, version_show, NULL);
+
+/* Features the card lacks leave their attributes out. */
+static umode_t pcimaxfm_attr_visible(struct kobject *kobj,
+		struct attribute *attr, int n)
+{
+	struct pcimaxfm_dev *dev = dev_get_drvdata(
+			container_of(kobj, struct device, kobj));
+	unsigned int caps = 0;
+
+#if PCIMAXFM_ENABLE_TX_TOGGLE
+	if (attr == &dev_attr_tx.attr)
+		caps = PCIMAXFM_CAP_TX;
+#endif /* PCIMAXFM_ENABLE_TX_TOGGLE */
+#if PCIMAXFM_ENABLE_RDS_TOGGLE
+	if (attr == &dev_attr_rdssignal.attr)
+		caps = PCIMAXFM_CAP_RDSSIGNAL;
+#endif /* PCIMAXFM_ENABLE_RDS_TOGGLE */
+
+	return pcimaxfm_has(dev, caps) ? attr->mode : 0;
+}
+
+#if PCIMAXFM_ENABLE_RDS
+/* One attribute per RDS parameter in the rds group, named after it. */
+struct pcimaxfm_rds_attr {
+	struct device_attribute attr;
+	int param;
+};
+
+static struct pcimaxfm_rds_attr pcimaxfm_rds_attrs[RDS_PARAM_END];
+static struct attribute *pcimaxfm_rds_attr_list[RDS_PARAM_END + 1];
+
+static ssize_t pcimaxfm_rds_show(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	struct pcimaxfm_dev *dev = dev_get_drvdata(d);
+	int param = container_of(attr, struct pcimaxfm_rds_attr, attr)->param;
+	char value[PCIMAXFM_RDS_VALUE_MAX + 1];
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&dev->state_seq);
+		memcpy(value, dev->rds[param], sizeof(value));
+	} while (read_seqcount_retry(&dev->state_seq, seq));
+
+	return snprintf(buf, PAGE_SIZE, "%s\n", value);
+}
+
+static ssize_t pcimaxfm_rds_store(struct device *d,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct pcimaxfm_dev *dev = dev_get_drvdata(d);
+	int param = container_of(attr, struct pcimaxfm_rds_attr, attr)->param;
+	struct pcimaxfm_request *req;
+	size_t len = count;
+	int ret;
+
+	if (len > 0 && buf[len - 1] == '\n')
+		len--;
+
+	if (len > PCIMAXFM_RDS_VALUE_MAX)
+		return -EINVAL;
+
+	if ((req = pcimaxfm_request_alloc(PCIMAXFM_REQ_RDS, 0, 1)) == NULL)
+		return -ENOMEM;
+
+	req->rds[0].param = param;
+	memcpy(req->rds[0].value, buf, len);
+	req->rds[0].value[len] = '\0';
+
+	if (validate_rds(param, req->rds[0].value, 0, NULL)) {
+		kfree(req);
+		return -EINVAL;
+	}
+
+	if ((ret = pcimaxfm_attr_submit(dev, req)))
+		return ret;
+
+	return count;
+}
+
+static umode_t pcimaxfm_rds_attr_visible(struct kobject *kobj,
+		struct attribute *attr, int n)
+{
+	struct pcimaxfm_dev *dev = dev_get_drvdata(
+			container_of(kobj, struct device, kobj));
+
+	return pcimaxfm_has(dev, PCIMAXFM_CAP_RDS) ? attr->mode : 0;
+}
+
+static const struct attribute_group pcimaxfm_rds_attr_group = {
+	.name       = "rds",
+	.attrs      = pcimaxfm_rds_attr_list,
+	.is_visible = pcimaxfm_rds_attr_visible
+};
+
+static void pcimaxfm_rds_init_attrs(void)
+{
+	int i;
+
+	for (i = 0; i < RDS_PARAM_END; i++) {
+		struct pcimaxfm_rds_attr *a = &pcimaxfm_rds_attrs[i];
+
+		sysfs_attr_init(&a->attr.attr);
+		a->attr.attr.name = rds_params_name[i];
+		a->attr.attr.mode = 0644;
+		a->attr.show      = pcimaxfm_rds_show;
+		a->attr.store     = pcimaxfm_rds_store;
+		a->param          = i;
+
+		pcimaxfm_rds_attr_list[i] = &a->attr.attr;
+	}
+
+	pcimaxfm_rds_attr_list[RDS_PARAM_END] = NULL;
+}
+#endif /* PCIMAXFM_ENABLE_RDS */
+
+static struct attribute *pcimaxfm_attrs[] = {
+#if PCIMAXFM_ENABLE_TX_TOGGLE
+	&dev_attr_tx.attr,
+#endif /* PCIMAXFM_ENABLE_TX_TOGGLE */
+	&dev_attr_freq.attr,
+	&dev_attr_power.attr,
+	&dev_attr_stereo.attr,
+#if PCIMAXFM_ENABLE_RDS_TOGGLE
+	&dev_attr_rdssignal.attr,
+#endif /* PCIMAXFM_ENABLE_RDS_TOGGLE */
+	&dev_attr_i2c_profile.attr,
+	&dev_attr_i2c_setup_us.attr,
+	&dev_attr_i2c_hold_us.attr,
+	&dev_attr_i2c_high_us.attr,
+	&dev_attr_i2c_low_us.attr,
+	&dev_attr_i2c_retries.attr,
+	&dev_attr_i2c_calibrate.attr,
+	&dev_attr_version.attr,
+	NULL
+};
 
-	dev->rdssignal = signal ? 1 : 0;
+static const struct attribute_group pcimaxfm_attr_group = {
+	.attrs      = pcimaxfm_attrs,
+	.is_visible = pcimaxfm_attr_visible
+};
 
-	valstr[0] = '0' + dev->rdssignal;
-	valstr[1] = '\0';
+static const struct attribute_group *pcimaxfm_attr_groups[] = {
+	&pcimaxfm_attr_group,
+#if PCIMAXFM_ENABLE_RDS
+	&pcimaxfm_rds_attr_group,
+#endif /* PCIMAXFM_ENABLE_RDS */
+	NULL
+};
 
-	pcimaxfm_write_rds(dev, "PWR", valstr);
-}
+static const char *pcimaxfm_ioctl_name[PCIMAXFM_STATS_IOCTLS] = {
+#if PCIMAXFM_ENABLE_TX_TOGGLE
+	[_IOC_NR(PCIMAXFM_TX_SET)]         = "tx_set",
+	[_IOC_NR(PCIMAXFM_TX_GET)]         = "tx_get",
+#endif /* PCIMAXFM_ENABLE_TX_TOGGLE */
+	[_IOC_NR(PCIMAXFM_FREQ_SET)]       = "freq_set",
+	[_IOC_NR(PCIMAXFM_FREQ_GET)]       = "freq_get",
+	[_IOC_NR(PCIMAXFM_POWER_SET)]      = "power_set",
+	[_IOC_NR(PCIMAXFM_POWER_GET)]      = "power_get",
+	[_IOC_NR(PCIMAXFM_STEREO_SET)]     = "stereo_set",
+	[_IOC_NR(PCIMAXFM_STEREO_GET)]     = "stereo_get",
+#if PCIMAXFM_ENABLE_RDS
+#if PCIMAXFM_ENABLE_RDS_TOGGLE
+	[_IOC_NR(PCIMAXFM_RDSSIGNAL_SET)]  = "rdssignal_set",
+	[_IOC_NR(PCIMAXFM_RDSSIGNAL_GET)]  = "rdssignal_get",
 #endif /* PCIMAXFM_ENABLE_RDS_TOGGLE */
+	[_IOC_NR(PCIMAXFM_RDS_SET)]        = "rds_set",
+	[_IOC_NR(PCIMAXFM_RDS_SET_BATCH)]  = "rds_set_batch",
+	[_IOC_NR(PCIMAXFM_RDS_GET)]        = "rds_get",
+	[_IOC_NR(PCIMAXFM_RDS_SET2)]       = "rds_set2",
+	[_IOC_NR(PCIMAXFM_RDS_SET_BATCH2)] = "rds_set_batch2",
+	[_IOC_NR(PCIMAXFM_RDS_COMMIT)]     = "rds_commit",
 #endif /* PCIMAXFM_ENABLE_RDS */
+	[_IOC_NR(PCIMAXFM_PING)]           = "ping",
+	[_IOC_NR(PCIMAXFM_FENCE)]          = "fence",
+	[_IOC_NR(PCIMAXFM_QUEUE_STATUS)]   = "queue_status",
+	[_IOC_NR(PCIMAXFM_BROADCAST)]      = "broadcast",
+	[_IOC_NR(PCIMAXFM_STATUS_GET)]     = "status_get",
+	[_IOC_NR(PCIMAXFM_BROADCAST2)]     = "broadcast2",
+	[_IOC_NR(PCIMAXFM_FORMAT_SET)]     = "format_set"
+};
 
-#if PCIMAXFM_ENABLE_TX_TOGGLE
-static void pcimaxfm_tx_set(struct pcimaxfm_dev *dev, int tx)
+static void pcimaxfm_stats_show_hist(struct seq_file *m, const char *name,
+		atomic_long_t *hist)
 {
-	if (tx) {
-		dev->io_data |= PCIMAXFM_TX;
-	} else {
-		dev->io_data &= ~PCIMAXFM_TX;
-	}
+	int i;
 
-	outb(dev->io_data, dev->base_addr + PCIMAXFM_OFFSET_DATA);
-}
+	for (i = 0; i < PCIMAXFM_STATS_BUCKETS - 1; i++)
+		seq_printf(m, "%s_lt_%lu %ld\n", name, 1UL << i,
+				atomic_long_read(&hist[i]));
 
-static int pcimaxfm_tx_get(struct pcimaxfm_dev *dev)
-{
-	return (dev->io_data & PCIMAXFM_TX) == PCIMAXFM_TX;
+	seq_printf(m, "%s_ge_%lu %ld\n", name, 1UL << (i - 1),
+			atomic_long_read(&hist[i]));
 }
-#endif /* PCIMAXFM_ENABLE_TX_TOGGLE */
 
-static void pcimaxfm_stereo_set(struct pcimaxfm_dev *dev, int stereo)
+static int pcimaxfm_stats_show(struct seq_file *m, void *v)
 {
-#if PCIMAXFM_INVERT_STEREO
-	stereo = !stereo;
-#endif
+	struct pcimaxfm_dev *dev = m->private;
+	struct pcimaxfm_stats *st = &dev->stats;
+	int i;
 
-	if (stereo) {
-		dev->io_data &= ~PCIMAXFM_MONO;
-	} else {
-		dev->io_data |= PCIMAXFM_MONO;
+	seq_printf(m, "pll_xfers %ld\n",
+			atomic_long_read(&st->xfers[PCIMAXFM_STATS_PLL]));
+	seq_printf(m, "pll_bytes %ld\n",
+			atomic_long_read(&st->bytes[PCIMAXFM_STATS_PLL]));
+	seq_printf(m, "rds_xfers %ld\n",
+			atomic_long_read(&st->xfers[PCIMAXFM_STATS_RDS]));
+	seq_printf(m, "rds_bytes %ld\n",
+			atomic_long_read(&st->bytes[PCIMAXFM_STATS_RDS]));
+	seq_printf(m, "nacks %ld\n", atomic_long_read(&st->nacks));
+	seq_printf(m, "retries %ld\n", atomic_long_read(&st->retries));
+	seq_printf(m, "spin_us %ld\n", atomic_long_read(&st->spin_us));
+	seq_printf(m, "bus_us %ld\n", atomic_long_read(&st->bus_us));
+
+	for (i = 0; i < PCIMAXFM_STATS_IOCTLS; i++) {
+		if (pcimaxfm_ioctl_name[i])
+			seq_printf(m, "ioctl_%s %ld\n", pcimaxfm_ioctl_name[i],
+					atomic_long_read(&st->ioctls[i]));
 	}
 
-	outb(dev->io_data, dev->base_addr + PCIMAXFM_OFFSET_DATA);
+	pcimaxfm_stats_show_hist(m, "freq_power_us", st->freq_power_us);
+	pcimaxfm_stats_show_hist(m, "rds_us", st->rds_us);
+
+	return 0;
 }
 
-static int pcimaxfm_stereo_get(struct pcimaxfm_dev *dev)
+static int pcimaxfm_stats_open(struct inode *inode, struct file *filp)
 {
-	int stereo = ((dev->io_data & PCIMAXFM_MONO) != PCIMAXFM_MONO);
-
-#if PCIMAXFM_INVERT_STEREO
-	return !stereo;
-#else
-	return stereo;
-#endif
+	return single_open(filp, pcimaxfm_stats_show, inode->i_private);
 }
 
-static int pcimaxfm_open(struct inode *inode, struct file *filp)
+static const struct file_operations pcimaxfm_stats_fops = {
+	.owner   = THIS_MODULE,
+	.open    = pcimaxfm_stats_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release
+};
+
+/* Statistics are optional, failing to create them is not an error. */
+static void pcimaxfm_debugfs_init(struct pcimaxfm_dev *dev)
 {
-	int ret = 0;
-	struct pcimaxfm_dev *dev = container_of(inode->i_cdev,
-			struct pcimaxfm_dev, cdev);
+	char name[16];
 
-	spin_lock(&dev->use_lock);
+	if (IS_ERR_OR_NULL(pcimaxfm_debugfs))
+		return;
 
-	if (dev->use_count && !capable(CAP_DAC_OVERRIDE)) {
-		ret = -EBUSY;
-		goto open_done;
-	}
+	snprintf(name, sizeof(name), PACKAGE "%u", dev->dev_num);
 
-	dev->use_count++;
-	filp->private_data = dev;
+	dev->debugfs = debugfs_create_dir(name, pcimaxfm_debugfs);
 
-open_done:
-	spin_unlock(&dev->use_lock);
+	if (IS_ERR_OR_NULL(dev->debugfs)) {
+		dev->debugfs = NULL;
+		return;
+	}
 
-	return ret;
+	debugfs_create_file("stats", 0444, dev->debugfs, dev,
+			&pcimaxfm_stats_fops);
 }
 
-static int pcimaxfm_release(struct inode *inode, struct file *filp)
+/* Control lines left as they are across loads of the driver. */
+static u8 pcimaxfm_ctrl_kept(const struct pcimaxfm_dev *dev)
+{
+	return pcimaxfm_has(dev, PCIMAXFM_CAP_TX) ?
+		PCIMAXFM_TX | PCIMAXFM_MONO : PCIMAXFM_MONO;
+}
+
+/* The value of the slot=value entry of a per-card parameter naming the card
+ * in slot, if any. */
+static const char *pcimaxfm_param_find(const char *slot, char **entries,
+		int num)
 {
-	struct pcimaxfm_dev *dev = filp->private_data;
+	size_t len = strlen(slot);
+	int i;
 
-	spin_lock(&dev->use_lock);
-	dev->use_count--;
-	spin_unlock(&dev->use_lock);
+	for (i = 0; i < num; i++) {
+		if (!strncmp(entries[i], slot, len) && entries[i][len] == '=')
+			return entries[i] + len + 1;
+	}
 
-	return 0;
+	return NULL;
 }
 
-static ssize_t pcimaxfm_read(struct file *filp, char __user *buf, size_t count,
-		loff_t *f_pos)
+static const struct pcimaxfm_card *pcimaxfm_card_find(const char *version)
 {
-	struct pcimaxfm_dev *dev = filp->private_data;
-	int len;
-	static char str[0xff], str_freq[0x20], str_power[0x6];
+	int i;
 
-	if (*f_pos != 0) {
-		return 0;
+	for (i = 0; i < ARRAY_SIZE(pcimaxfm_cards); i++) {
+		if (!strcmp(version, pcimaxfm_cards[i].version))
+			return &pcimaxfm_cards[i];
 	}
 
-	if (dev->freq == PCIMAXFM_FREQ_NA) {
-		snprintf(str_freq, sizeof(str_freq), "NA");
-	} else {
-		snprintf(str_freq, sizeof(str_freq),
-				"%u.%u%u MHz (%u 50 KHz steps)",
-				dev->freq / 20,
-				(dev->freq % 20) / 2,
-				(dev->freq % 2 == 0 ? 0 : 5),
-				dev->freq);
-	}
+	return NULL;
+}
 
-	if (dev->power == PCIMAXFM_POWER_NA) {
-		snprintf(str_power, sizeof(str_power), "NA/%u",
-				PCIMAXFM_POWER_MAX);
-	} else {
-		snprintf(str_power, sizeof(str_power), "%u/%u",
-				dev->power, PCIMAXFM_POWER_MAX);
-	}
+/* The configured version unless the card_version parameter names another
+ * for the card in slot. */
+static void pcimaxfm_card_init(struct pcimaxfm_dev *dev, const char *slot)
+{
+#if PCIMAXFM_DETECT_VERSION
+	const char *version = pcimaxfm_param_find(slot, card_version,
+			card_version_num);
+#endif /* PCIMAXFM_DETECT_VERSION */
 
-	snprintf(str, sizeof(str),
-#if PCIMAXFM_ENABLE_TX_TOGGLE
-			"TX      : %s\n"
-#endif /* PCIMAXFM_ENABLE_TX_TOGGLE */
-			"Freq    : %s\n"
-			"Power   : %s\n"
-			"Stereo  : %s\n"
-#if PCIMAXFM_ENABLE_RDS_TOGGLE
-			"RDS     : %s\n"
-#endif /* PCIMAXFM_ENABLE_RDS_TOGGLE */
-			"\n"
-			"Address : %#lx\n"
-			"Control : %#x\n"
-			"Data    : %#x\n",
-#if PCIMAXFM_ENABLE_TX_TOGGLE
-			 PCIMAXFM_STR_BOOL(pcimaxfm_tx_get(dev)),
-#endif /* PCIMAXFM_ENABLE_TX_TOGGLE */
-			str_freq, str_power,
-			PCIMAXFM_STR_BOOL(pcimaxfm_stereo_get(dev)),
-#if PCIMAXFM_ENABLE_RDS_TOGGLE
-			PCIMAXFM_STR_BOOL(dev->rdssignal),
-#endif /* PCIMAXFM_ENABLE_RDS_TOGGLE */
-			dev->base_addr, dev->io_ctrl, dev->io_data);
+	dev->card = pcimaxfm_card_find(PCIMAXFM_DEVICE_VERSION);
 
-	len = strlen(str);
+#if PCIMAXFM_DETECT_VERSION
+	if (version) {
+		const struct pcimaxfm_card *card = pcimaxfm_card_find(version);
 
-	if ((count < len) || copy_to_user(buf, str, len)) {
-		return -EFAULT;
+		if (card)
+			dev->card = card;
+		else
+			KMSG_ERRN("Unknown card version \"%s\", using %s.",
+					version, dev->card->version);
 	}
+#endif /* PCIMAXFM_DETECT_VERSION */
 
-	*f_pos = len;
-
-	return len;
+	dev->caps = dev->card->caps & PCIMAXFM_CAPS;
 }
 
-static long pcimaxfm_ioctl(struct file *filp, unsigned int cmd,
-		unsigned long arg)
+static int pcimaxfm_defaults_print(struct pcimaxfm_dev *dev, char *buf,
+		size_t size, const char *key, char **entries, int num)
 {
+	const char *value = pcimaxfm_param_find(pci_name(dev->pci_dev),
+			entries, num);
 	int data;
-	struct pcimaxfm_dev *dev = filp->private_data;
-#if PCIMAXFM_ENABLE_RDS
-	struct pcimaxfm_rds_set rds;
-#endif /* PCIMAXFM_ENABLE_RDS_TOGGLE */
-
-	switch (cmd) {
-#if PCIMAXFM_ENABLE_TX_TOGGLE
-		case PCIMAXFM_TX_SET:
-			if (get_user(data, (int __user *)arg))
-				return -1;
-
-			pcimaxfm_tx_set(dev, data);
-			break;
-
-		case PCIMAXFM_TX_GET:
-			if (put_user(pcimaxfm_tx_get(dev),
-						(int __user *)arg))
-				return -1;
 
-			break;
-#endif /* PCIMAXFM_ENABLE_TX_TOGGLE */
+	if (value == NULL)
+		return 0;
 
-		case PCIMAXFM_FREQ_SET:
-			if (get_user(data, (int __user *)arg))
-				return -1;
+	if (kstrtoint(value, 0, &data)) {
+		KMSG_ERRN("Invalid %s \"%s\" for card %s.", key, value,
+				pci_name(dev->pci_dev));
+		return 0;
+	}
 
-			pcimaxfm_write_freq_power(dev, data, dev->power);
-			break;
+	return scnprintf(buf, size, "%s=%d\n", key, data);
+}
 
-		case PCIMAXFM_FREQ_GET:
-			if (put_user(dev->freq, (int __user *)arg))
-				return -1;
-			break;
+/* Bring a new card on air with the freq, power and stereo parameters
+ * followed by the lines of its config file, PACKAGE-<slot>.conf in the
+ * firmware search path, if there is one. The settings go through the queue
+ * after anything probe queued before and are waited for. */
+static void pcimaxfm_defaults_apply(struct pcimaxfm_dev *dev)
+{
+	const struct firmware *fw;
+	char name[0x40], *buf;
+	size_t len = 0, size = 0x40;
+	ssize_t ret;
+
+	snprintf(name, sizeof(name), PACKAGE "-%s.conf",
+			pci_name(dev->pci_dev));
+
+	if (request_firmware_direct(&fw, name, &dev->pci_dev->dev)) {
+		fw = NULL;
+	} else if (fw->size > PCIMAXFM_WRITE_MAX) {
+		KMSG_ERRN("Config file %s is too large.", name);
+		release_firmware(fw);
+		fw = NULL;
+	}
 
-		case PCIMAXFM_POWER_SET:
-			if (get_user(data, (int __user *)arg))
-				return -1;
-			
-			pcimaxfm_write_freq_power(dev, dev->freq, data);
-			break;
+	if (fw)
+		size += fw->size + 1;
 
-		case PCIMAXFM_POWER_GET:
-			if (put_user(dev->power, (int __user *)arg))
-				return -1;
+	if ((buf = kmalloc(size + 1, GFP_KERNEL)) == NULL) {
+		release_firmware(fw);
+		return;
+	}
 
-			break;
+	len += pcimaxfm_defaults_print(dev, buf + len, size - len, "FREQ",
+			default_freq, default_freq_num);
+	len += pcimaxfm_defaults_print(dev, buf + len, size - len, "POWER",
+			default_power, default_power_num);
+	len += pcimaxfm_defaults_print(dev, buf + len, size - len, "STEREO",
+			default_stereo, default_stereo_num);
+
+	if (fw) {
+		memcpy(buf + len, fw->data, fw->size);
+		len += fw->size;
+		release_firmware(fw);
+
+		/* The last line of a file may lack its newline. */
+		if (len > 0 && buf[len - 1] != '\n')
+			buf[len++] = '\n';
+	}
 
-		case PCIMAXFM_STEREO_SET:
-			if (get_user(data, (int __user *)arg))
-				return -1;
+	buf[len] = '\0';
 
-			pcimaxfm_stereo_set(dev, data);
-			break;
+	if (len > 0 && (ret = pcimaxfm_apply(dev, NULL, buf, len, 0)) !=
+			(ssize_t)len)
+		KMSG_ERRN("Couldn't apply default settings past byte %zd.",
+				ret < 0 ? 0 : ret);
 
-		case PCIMAXFM_STEREO_GET:
-			if (put_user(pcimaxfm_stereo_get(dev),
-						(int __user *)arg))
-				return -1;
+	kfree(buf);
+}
 
-			break;
+static int pcimaxfm_shm_alloc(struct pcimaxfm_dev *dev)
+{
+	if ((dev->shm = vmalloc_user(sizeof(*dev->shm))) == NULL)
+		return -ENOMEM;
 
 #if PCIMAXFM_ENABLE_RDS
-#if PCIMAXFM_ENABLE_RDS_TOGGLE
-		case PCIMAXFM_RDSSIGNAL_SET:
-			if (get_user(data, (int __user *)arg))
-				return -1;
-
-			pcimaxfm_rdssignal_set(dev, data);
-			break;
-
-		case PCIMAXFM_RDSSIGNAL_GET:
-			if (put_user(dev->rdssignal, (int __user *)arg))
-				return -1;
-
-			break;
-#endif /* PCIMAXFM_ENABLE_RDS_TOGGLE */
-
-		case PCIMAXFM_RDS_SET:
-			if(copy_from_user(&rds,
-					(struct pcimaxfm_rds_set __user *)arg,
-					sizeof(rds)) != 0)
-				return -1;
-
-			if (validate_rds(rds.param, rds.value, 0, NULL)) {
-				KMSG_ERRN("Invalid RDS set received.");
-				return -1;
-			}
-
-			pcimaxfm_write_rds(dev,
-					rds_params_name[rds.param], rds.value);
-			break;
+	if ((dev->rds_stage = vmalloc_user(sizeof(*dev->rds_stage))) == NULL)
+		return -ENOMEM;
 #endif /* PCIMAXFM_ENABLE_RDS */
 
-		default:
-			return -ENOTTY;
-	}
-
 	return 0;
 }
 
-static struct file_operations pcimaxfm_fops = {
-	.owner          = THIS_MODULE,
-	.read           = pcimaxfm_read,
-	.unlocked_ioctl = pcimaxfm_ioctl,
-	.open           = pcimaxfm_open,
-	.release        = pcimaxfm_release
-};
-
 static int pcimaxfm_probe(struct pci_dev *pci_dev,
 		const struct pci_device_id *id)
 {
-	int ret;
+	int i, ret;
 	struct pcimaxfm_dev *dev;
+	struct pcimaxfm_request *req;
+	const char *cpu;
 	dev_t dev_t;
 
-	if (pcimaxfm_num_devs >= PCIMAXFM_MAX_DEVS) {
-		KMSG_ERR("Couldn't init card %u, increase max number of "
-				"devices (%u).",
-				pcimaxfm_num_devs, PCIMAXFM_MAX_DEVS);
+	if ((dev = kzalloc_node(sizeof(*dev), GFP_KERNEL,
+					dev_to_node(&pci_dev->dev))) == NULL)
 		return -ENOMEM;
+
+	kref_init(&dev->ref);
+
+	if ((ret = pcimaxfm_shm_alloc(dev))) {
+		kref_put(&dev->ref, pcimaxfm_dev_free);
+		return ret;
+	}
+
+	/* Only reserves the minor, the card is published once it's set up,
+	 * see below. */
+	mutex_lock(&pcimaxfm_idr_lock);
+	ret = idr_alloc(&pcimaxfm_idr, NULL, 0, PCIMAXFM_MAX_DEVS, GFP_KERNEL);
+	mutex_unlock(&pcimaxfm_idr_lock);
+
+	if (ret < 0) {
+		KMSG_ERR("Couldn't init card %s, increase max number of "
+				"devices (%u).",
+				pci_name(pci_dev), PCIMAXFM_MAX_DEVS);
+		kref_put(&dev->ref, pcimaxfm_dev_free);
+		return ret;
 	}
 
-	dev = &pcimaxfm_devs[pcimaxfm_num_devs];
-	dev->dev_num   = pcimaxfm_num_devs;
+	dev->dev_num   = ret;
 	dev->freq      = PCIMAXFM_FREQ_NA;
 	dev->power     = PCIMAXFM_POWER_NA;
+	pcimaxfm_card_init(dev, pci_name(pci_dev));
 #if PCIMAXFM_ENABLE_RDS_TOGGLE
 	dev->rdssignal = PCIMAXFM_BOOL_NA;
+	if (pcimaxfm_has(dev, PCIMAXFM_CAP_RDSSIGNAL))
+		pcimaxfm_rds_pwr_compile(dev);
 #endif /* PCIMAXFM_ENABLE_RDS_TOGGLE*/
+#if PCIMAXFM_ENABLE_RDS
+	memset(dev->rds, 0, sizeof(dev->rds));
+	bitmap_fill(dev->rds_dirty, RDS_PARAM_END);
+#endif /* PCIMAXFM_ENABLE_RDS */
 	dev->use_count = 0;
 	spin_lock_init(&dev->use_lock);
 
+	mutex_init(&dev->bus_lock);
+	seqcount_init(&dev->state_seq);
+	pcimaxfm_state_publish(dev);
+
+	spin_lock_init(&dev->queue_lock);
+	for (i = 0; i < PCIMAXFM_LANES; i++) {
+		INIT_LIST_HEAD(&dev->lanes[i]);
+		dev->lane_vtime[i] = 0;
+		dev->vfinish[i]    = 0;
+	}
+	dev->preempt   = 0;
+	dev->queue_len = 0;
+	dev->seq       = 0;
+	dev->done_seq  = 0;
+	dev->active    = NULL;
+	init_waitqueue_head(&dev->queue_wait);
+	INIT_WORK(&dev->work, pcimaxfm_queue_work);
+
+	dev->cpu = -1;
+
+	if ((cpu = pcimaxfm_param_find(pci_name(pci_dev), worker_cpu,
+					worker_cpu_num)) != NULL) {
+		if (!kstrtoint(cpu, 0, &i) && i >= 0 && i < nr_cpu_ids &&
+				cpu_online(i))
+			dev->cpu = i;
+		else
+			KMSG_ERRN("CPU %s is not online, worker not pinned.",
+					cpu);
+	}
+
+	/* Frozen across system sleep, so the ports are left alone while the
+	 * card is down. */
+	if ((dev->wq = alloc_workqueue("%s%u", WQ_FREEZABLE |
+					(dev->cpu >= 0 ? 0 : WQ_UNBOUND), 1,
+					PACKAGE, dev->dev_num)) == NULL) {
+		KMSG_ERRN("Couldn't create workqueue.");
+		ret = -ENOMEM;
+		goto err_alloc_workqueue;
+	}
+
+	dev->i2c_profile = pcimaxfm_i2c_default_profile;
+	dev->i2c.port    = dev;
+	dev->i2c.timing  = pcimaxfm_i2c_profiles[dev->i2c_profile];
+	dev->i2c.retries = min_t(unsigned int, i2c_retries,
+			PCIMAXFM_I2C_RETRIES_MAX);
+
 	dev->pci_dev   = pci_dev_get(pci_dev);
 	pci_set_drvdata(pci_dev, dev);
 
-	pcimaxfm_num_devs++;
-
 	if ((ret = pci_enable_device(pci_dev))) {
 		KMSG_ERRN("Couldn't enable device.");
 		goto err_pci_enable_device;
@@ -521,33 +3576,42 @@ static int pcimaxfm_probe(struct pci_dev *pci_dev,
 		goto err_request_region;
 	}
 
-	cdev_init(&dev->cdev, &pcimaxfm_fops);
-	dev->cdev.owner = THIS_MODULE;
+	/* The cdev is refcounted on its own, as open files may outlive the
+	 * card. */
+	if ((dev->cdev = cdev_alloc()) == NULL) {
+		KMSG_ERRN("Couldn't allocate cdev.");
+		ret = -ENOMEM;
+		goto err_cdev_alloc;
+	}
+
+	dev->cdev->ops   = &pcimaxfm_fops;
+	dev->cdev->owner = THIS_MODULE;
 	dev_t = MKDEV(pcimaxfm_major, dev->dev_num);
 
-	if ((ret = cdev_add(&dev->cdev, dev_t, 1))) {
+	if ((ret = cdev_add(dev->cdev, dev_t, 1))) {
 		KMSG_ERRN("Couldn't add cdev.");
 		goto err_cdev_add;
 	}
 
-	if (IS_ERR(device_create(pcimaxfm_class, NULL, dev_t, NULL,
-				PACKAGE "%d", dev->dev_num))) {
+	if (IS_ERR(device_create_with_groups(pcimaxfm_class, NULL, dev_t, dev,
+				pcimaxfm_attr_groups, PACKAGE "%d",
+				dev->dev_num))) {
 		KMSG_ERRN("Couldn't create class device.");
 		ret = -1;
 		goto err_device_create;
 	}
 
-	KMSG_INFON("Found card %s, base address %#lx",
-			pci_name(pci_dev), dev->base_addr);
+	KMSG_INFON("Found card %s, version %s, base address %#lx",
+			pci_name(pci_dev), dev->card->version, dev->base_addr);
+
+	pcimaxfm_debugfs_init(dev);
+
+	mutex_lock(&dev->bus_lock);
 
 	/* Get TX and stereo encoder state if their control lines are
 	 * already enabled. */
-	dev->io_ctrl =
-		inb(dev->base_addr + PCIMAXFM_OFFSET_CTRL) & (
-#if PCIMAXFM_ENABLE_TX_TOGGLE
-				PCIMAXFM_TX |
-#endif /* PCIMAXFM_ENABLE_TX_TOGGLE */
-				PCIMAXFM_MONO);
+	dev->io_ctrl = inb(dev->base_addr + PCIMAXFM_OFFSET_CTRL) &
+		pcimaxfm_ctrl_kept(dev);
 
 	if ((dev->io_ctrl & PCIMAXFM_MONO) == PCIMAXFM_MONO) {
 		dev->io_data = inb(dev->base_addr + PCIMAXFM_OFFSET_DATA)
@@ -556,31 +3620,57 @@ static int pcimaxfm_probe(struct pci_dev *pci_dev,
 		dev->io_data = 0;
 	}
 
-#if PCIMAXFM_ENABLE_TX_TOGGLE
 	if ((dev->io_ctrl & PCIMAXFM_TX) == PCIMAXFM_TX) {
 		dev->io_data |= inb(dev->base_addr + PCIMAXFM_OFFSET_DATA)
 			& PCIMAXFM_TX;
 	}
-#endif /* PCIMAXFM_ENABLE_TX_TOGGLE */
 
 	/* Enable TX, stereo encoder control and I2C. */
-	dev->io_ctrl |= (
-#if PCIMAXFM_ENABLE_TX_TOGGLE
-			PCIMAXFM_TX |
-#endif /* PCIMAXFM_ENABLE_TX_TOGGLE */
-			PCIMAXFM_MONO | PCIMAXFM_I2C_SDA | PCIMAXFM_I2C_SCL);
+	dev->io_ctrl |= pcimaxfm_ctrl_kept(dev) |
+		PCIMAXFM_I2C_SDA | PCIMAXFM_I2C_SCL;
 	outb(dev->io_ctrl, dev->base_addr + PCIMAXFM_OFFSET_CTRL);
 
+	pcimaxfm_state_publish(dev);
+	mutex_unlock(&dev->bus_lock);
+
+	/* Open and broadcast find the card from here on. */
+	mutex_lock(&pcimaxfm_idr_lock);
+	idr_replace(&pcimaxfm_idr, dev, dev->dev_num);
+	mutex_unlock(&pcimaxfm_idr_lock);
+
+	if (i2c_calibrate && (req = pcimaxfm_request_alloc(
+					PCIMAXFM_REQ_CALIBRATE, 0, 0)))
+		pcimaxfm_queue_submit(dev, NULL, req, 0);
+
+	pcimaxfm_defaults_apply(dev);
+
 	return 0;
 
 err_device_create:
-	cdev_del(&dev->cdev);
+	cdev_del(dev->cdev);
+	goto err_cdev_alloc;
 err_cdev_add:
+	/* Never added, so only the allocation is dropped. */
+	kobject_put(&dev->cdev->kobj);
+err_cdev_alloc:
 	release_region(dev->base_addr, PCIMAXFM_REGION_LENGTH);
 err_request_region:
 	pci_disable_device(pci_dev);
 err_pci_enable_device:
 	pci_dev_put(pci_dev);
+err_alloc_workqueue:
+	spin_lock(&dev->queue_lock);
+	WRITE_ONCE(dev->gone, 1);
+	spin_unlock(&dev->queue_lock);
+
+	mutex_lock(&pcimaxfm_idr_lock);
+	idr_remove(&pcimaxfm_idr, dev->dev_num);
+	mutex_unlock(&pcimaxfm_idr_lock);
+
+	if (dev->wq)
+		destroy_workqueue(dev->wq);
+
+	kref_put(&dev->ref, pcimaxfm_dev_free);
 
 	return ret;
 }
@@ -592,32 +3682,97 @@ static void pcimaxfm_remove(struct pci_dev *pci_dev)
 	if (dev == NULL) {
 		KMSG_ERR("Couldn't find PCI driver data for removal.");
 	} else {
+		debugfs_remove_recursive(dev->debugfs);
+		cdev_del(dev->cdev);
+
+		/* Refuse new requests from files still open and finish queued
+		 * ones before letting go of the ports. */
+		spin_lock(&dev->queue_lock);
+		WRITE_ONCE(dev->gone, 1);
+		spin_unlock(&dev->queue_lock);
+
+		wake_up_all(&dev->queue_wait);
+		destroy_workqueue(dev->wq);
+
+		mutex_lock(&dev->bus_lock);
+
 		/* Disable everything but TX and stereo encoder state. */
-		dev->io_ctrl &= (
-#if PCIMAXFM_ENABLE_TX_TOGGLE
-				PCIMAXFM_TX |
-#endif /* PCIMAXFM_ENABLE_TX_TOGGLE */
-				PCIMAXFM_MONO);
+		dev->io_ctrl &= pcimaxfm_ctrl_kept(dev);
 		outb(dev->io_ctrl, dev->base_addr + PCIMAXFM_OFFSET_CTRL);
 
-		dev->io_data &= (
-#if PCIMAXFM_ENABLE_TX_TOGGLE
-				PCIMAXFM_TX |
-#endif /* PCIMAXFM_ENABLE_TX_TOGGLE */
-				PCIMAXFM_MONO);
+		dev->io_data &= pcimaxfm_ctrl_kept(dev);
 		outb(dev->io_data, dev->base_addr + PCIMAXFM_OFFSET_DATA);
 
+		mutex_unlock(&dev->bus_lock);
+
 		release_region(dev->base_addr, PCIMAXFM_REGION_LENGTH);
-		cdev_del(&dev->cdev);
 		device_destroy(pcimaxfm_class,
 				MKDEV(pcimaxfm_major, dev->dev_num));
+
+		mutex_lock(&pcimaxfm_idr_lock);
+		idr_remove(&pcimaxfm_idr, dev->dev_num);
+		mutex_unlock(&pcimaxfm_idr_lock);
 	}
 
 	pci_disable_device(pci_dev);
 	pci_dev_put(pci_dev);
+
+	if (dev)
+		kref_put(&dev->ref, pcimaxfm_dev_free);
+}
+
+/* Called with bus_lock held once the card lost its settings. The ports are
+ * written back at once, the targets on the bus by the work item ahead of
+ * any queued request. */
+static void pcimaxfm_lost(struct pcimaxfm_dev *dev)
+{
+	outb(dev->io_data, dev->base_addr + PCIMAXFM_OFFSET_DATA);
+	outb(dev->io_ctrl, dev->base_addr + PCIMAXFM_OFFSET_CTRL);
+	dev->restore = 1;
+
+	spin_lock(&dev->queue_lock);
+	if (!dev->gone)
+		pcimaxfm_queue_kick(dev);
+	spin_unlock(&dev->queue_lock);
+}
+
+#ifdef CONFIG_PM_SLEEP
+static int pcimaxfm_resume(struct device *d)
+{
+	struct pcimaxfm_dev *dev = dev_get_drvdata(d);
+
+	mutex_lock(&dev->bus_lock);
+	pcimaxfm_lost(dev);
+	mutex_unlock(&dev->bus_lock);
+
+	return 0;
+}
+#endif /* CONFIG_PM_SLEEP */
+
+static SIMPLE_DEV_PM_OPS(pcimaxfm_pm_ops, NULL, pcimaxfm_resume);
+
+/* The ports are kept quiet from before a reset until it's done. */
+static void pcimaxfm_reset_prepare(struct pci_dev *pci_dev)
+{
+	struct pcimaxfm_dev *dev = pci_get_drvdata(pci_dev);
+
+	mutex_lock(&dev->bus_lock);
+}
+
+static void pcimaxfm_reset_done(struct pci_dev *pci_dev)
+{
+	struct pcimaxfm_dev *dev = pci_get_drvdata(pci_dev);
+
+	pcimaxfm_lost(dev);
+	mutex_unlock(&dev->bus_lock);
 }
 
-static DEFINE_PCI_DEVICE_TABLE(pcimaxfm_id_table) = {
+static const struct pci_error_handlers pcimaxfm_err_handler = {
+	.reset_prepare = pcimaxfm_reset_prepare,
+	.reset_done    = pcimaxfm_reset_done
+};
+
+static const struct pci_device_id pcimaxfm_id_table[] = {
 	{
 		.vendor    = PCIMAXFM_VENDOR,
 		.device    = PCIMAXFM_DEVICE,
@@ -627,17 +3782,62 @@ static DEFINE_PCI_DEVICE_TABLE(pcimaxfm_id_table) = {
 };
 
 static struct pci_driver pcimaxfm_driver = {
-	.name     = PACKAGE,
-	.id_table = pcimaxfm_id_table,
-	.probe    = pcimaxfm_probe,
-	.remove   = pcimaxfm_remove
+	.name        = PACKAGE,
+	.id_table    = pcimaxfm_id_table,
+	.probe       = pcimaxfm_probe,
+	.remove      = pcimaxfm_remove,
+	.err_handler = &pcimaxfm_err_handler,
+	/* Cards are brought on air in parallel without holding up boot. */
+	.driver      = {
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+		.pm         = &pcimaxfm_pm_ops
+	}
 };
 
+static int pcimaxfm_i2c_init_profiles(void)
+{
+	int i;
+	struct pcimaxfm_i2c_timing *custom =
+		&pcimaxfm_i2c_profiles[PCIMAXFM_I2C_CUSTOM];
+
+	custom->setup = clamp_t(unsigned int, i2c_setup_us, 1,
+			PCIMAXFM_I2C_DELAY_MAX_USECS);
+	custom->hold  = clamp_t(unsigned int, i2c_hold_us, 1,
+			PCIMAXFM_I2C_DELAY_MAX_USECS);
+	custom->high  = clamp_t(unsigned int, i2c_high_us, 1,
+			PCIMAXFM_I2C_DELAY_MAX_USECS);
+	custom->low   = clamp_t(unsigned int, i2c_low_us, 1,
+			PCIMAXFM_I2C_DELAY_MAX_USECS);
+
+	for (i = 0; i < PCIMAXFM_I2C_PROFILE_END; i++) {
+		if (!strcmp(i2c_profile, pcimaxfm_i2c_profile_name[i])) {
+			pcimaxfm_i2c_default_profile = i;
+			return 0;
+		}
+	}
+
+	KMSG_ERR("Unknown I2C timing profile \"%s\".", i2c_profile);
+
+	return -EINVAL;
+}
+
 static int __init pcimaxfm_init(void)
 {
 	int ret;
 	dev_t dev = MKDEV(pcimaxfm_major, 0);
 
+	if ((ret = pcimaxfm_i2c_init_profiles()))
+		return ret;
+
+	/* The size must fit the ioctl number. */
+	BUILD_BUG_ON(sizeof(struct pcimaxfm_broadcast2) >= 1 << _IOC_SIZEBITS);
+	BUILD_BUG_ON(PCIMAXFM_MAX_DEVS > PCIMAXFM_BROADCAST_MAX);
+
+#if PCIMAXFM_ENABLE_RDS
+	BUILD_BUG_ON(PCIMAXFM_RDS_PARAMS != RDS_PARAM_END);
+	pcimaxfm_rds_init_attrs();
+#endif /* PCIMAXFM_ENABLE_RDS */
+
 	if (pcimaxfm_major) {
 		ret = register_chrdev_region(dev, PCIMAXFM_MAX_DEVS, PACKAGE);
 	} else {
@@ -657,6 +3857,8 @@ static int __init pcimaxfm_init(void)
 		goto err_class_create;
 	}
 
+	pcimaxfm_debugfs = debugfs_create_dir(PACKAGE, NULL);
+
 	if ((ret = pci_register_driver(&pcimaxfm_driver))) {
 		KMSG_ERR("Couldn't register PCI driver.");
 		goto err_pci_register_driver;
@@ -665,6 +3867,7 @@ static int __init pcimaxfm_init(void)
 	return 0;
 
 err_pci_register_driver:
+	debugfs_remove_recursive(pcimaxfm_debugfs);
 	class_destroy(pcimaxfm_class);
 err_class_create:
 	unregister_chrdev_region(dev, PCIMAXFM_MAX_DEVS);
@@ -676,6 +3879,9 @@ static void __exit pcimaxfm_exit(void)
 {
 	pci_unregister_driver(&pcimaxfm_driver);
 
+	idr_destroy(&pcimaxfm_idr);
+	debugfs_remove_recursive(pcimaxfm_debugfs);
+
 	class_destroy(pcimaxfm_class);
 
 	unregister_chrdev_region(MKDEV(pcimaxfm_major, 0), PCIMAXFM_MAX_DEVS);
@@ -0,0 +1,177 @@
+/*
+ * pcimaxfm - PCI MAX FM transmitter driver and tools
+ * Copyright (C) 2007-2013 Daniel Stien <daniel@stien.org>
+ *  
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software 
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM pcimaxfm
+
+#if !defined(_PCIMAXFM_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _PCIMAXFM_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(pcimaxfm_ioctl_enter,
+	TP_PROTO(unsigned int dev_num, unsigned int cmd),
+	TP_ARGS(dev_num, cmd),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, dev_num)
+		__field(unsigned int, cmd)
+	),
+
+	TP_fast_assign(
+		__entry->dev_num = dev_num;
+		__entry->cmd     = cmd;
+	),
+
+	TP_printk("dev=%u nr=%u", __entry->dev_num, _IOC_NR(__entry->cmd))
+);
+
+TRACE_EVENT(pcimaxfm_ioctl_exit,
+	TP_PROTO(unsigned int dev_num, unsigned int cmd, long ret),
+	TP_ARGS(dev_num, cmd, ret),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, dev_num)
+		__field(unsigned int, cmd)
+		__field(long, ret)
+	),
+
+	TP_fast_assign(
+		__entry->dev_num = dev_num;
+		__entry->cmd     = cmd;
+		__entry->ret     = ret;
+	),
+
+	TP_printk("dev=%u nr=%u ret=%ld", __entry->dev_num,
+		_IOC_NR(__entry->cmd), __entry->ret)
+);
+
+/* Sequence numbers tie a queued request to the ioctl or write() that
+ * returned it. */
+TRACE_EVENT(pcimaxfm_request_queue,
+	TP_PROTO(unsigned int dev_num, unsigned int seq, int type,
+		unsigned int depth),
+	TP_ARGS(dev_num, seq, type, depth),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, dev_num)
+		__field(unsigned int, seq)
+		__field(int, type)
+		__field(unsigned int, depth)
+	),
+
+	TP_fast_assign(
+		__entry->dev_num = dev_num;
+		__entry->seq     = seq;
+		__entry->type    = type;
+		__entry->depth   = depth;
+	),
+
+	TP_printk("dev=%u seq=%u type=%d depth=%u", __entry->dev_num,
+		__entry->seq, __entry->type, __entry->depth)
+);
+
+TRACE_EVENT(pcimaxfm_request_done,
+	TP_PROTO(unsigned int dev_num, unsigned int seq, int type, int result,
+		s64 usecs),
+	TP_ARGS(dev_num, seq, type, result, usecs),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, dev_num)
+		__field(unsigned int, seq)
+		__field(int, type)
+		__field(int, result)
+		__field(s64, usecs)
+	),
+
+	TP_fast_assign(
+		__entry->dev_num = dev_num;
+		__entry->seq     = seq;
+		__entry->type    = type;
+		__entry->result  = result;
+		__entry->usecs   = usecs;
+	),
+
+	TP_printk("dev=%u seq=%u type=%d result=%d usecs=%lld",
+		__entry->dev_num, __entry->seq, __entry->type,
+		__entry->result, __entry->usecs)
+);
+
+TRACE_EVENT(pcimaxfm_i2c_start,
+	TP_PROTO(unsigned int dev_num, u8 addr),
+	TP_ARGS(dev_num, addr),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, dev_num)
+		__field(u8, addr)
+	),
+
+	TP_fast_assign(
+		__entry->dev_num = dev_num;
+		__entry->addr    = addr;
+	),
+
+	TP_printk("dev=%u addr=%#x", __entry->dev_num, __entry->addr)
+);
+
+TRACE_EVENT(pcimaxfm_i2c_byte,
+	TP_PROTO(unsigned int dev_num, u8 value, int nack),
+	TP_ARGS(dev_num, value, nack),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, dev_num)
+		__field(u8, value)
+		__field(int, nack)
+	),
+
+	TP_fast_assign(
+		__entry->dev_num = dev_num;
+		__entry->value   = value;
+		__entry->nack    = nack;
+	),
+
+	TP_printk("dev=%u value=%#04x %s", __entry->dev_num, __entry->value,
+		__entry->nack ? "nack" : "ack")
+);
+
+/* Time since the matching start condition. */
+TRACE_EVENT(pcimaxfm_i2c_stop,
+	TP_PROTO(unsigned int dev_num, s64 usecs),
+	TP_ARGS(dev_num, usecs),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, dev_num)
+		__field(s64, usecs)
+	),
+
+	TP_fast_assign(
+		__entry->dev_num = dev_num;
+		__entry->usecs   = usecs;
+	),
+
+	TP_printk("dev=%u usecs=%lld", __entry->dev_num, __entry->usecs)
+);
+
+#endif /* _PCIMAXFM_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE trace
+
+#include <trace/define_trace.h>
@@ -0,0 +1,400 @@
+/*
+ * pcimaxfm - PCI MAX FM transmitter driver and tools
+ * Copyright (C) 2007-2013 Daniel Stien <daniel@stien.org>
+ *  
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software 
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <pcimaxfm.h>
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../../common/i2c.h"
+#include "../../common/rds.h"
+#include "sim.h"
+
+#define BATCH_LEN (RDS_PARAM_END * PCIMAXFM_RDS_FRAME_MAX)
+
+struct profile {
+	const char *name;
+	struct pcimaxfm_i2c_timing timing;
+};
+
+/* Same as the driver profiles. */
+static const struct profile profiles[] = {
+	{ "conservative", { 100, 100, 100, 200 } },
+	{ "standard",     {   1,   1,   4,   5 } },
+	{ "fast",         {   1,   1,   1,   2 } }
+};
+
+struct workload {
+	const char *name;
+	unsigned char addr;
+	unsigned char buf[BATCH_LEN];
+	int len;
+
+	/* Replayed from a compiled wave rather than sequenced. */
+	int compiled;
+	struct pcimaxfm_i2c_wave wave;
+};
+
+static struct workload workloads[6];
+static int workload_count = 0;
+
+static int failures = 0;
+
+static void check(int ok, const char *what)
+{
+	if (!ok) {
+		fprintf(stderr, "FAIL: %s\n", what);
+		failures++;
+	}
+}
+
+static void add_workload(const char *name, unsigned char addr,
+		const unsigned char *buf, int len, int compiled)
+{
+	struct workload *w = &workloads[workload_count++];
+
+	w->name = name;
+	w->addr = addr;
+	memcpy(w->buf, buf, len);
+	w->len = len;
+	w->compiled = compiled;
+
+	if (compiled)
+		check(!pcimaxfm_i2c_compile(&w->wave, addr, buf, len), name);
+}
+
+static void init_workloads(void)
+{
+	unsigned char buf[BATCH_LEN];
+	char value[PCIMAXFM_RDS_VALUE_MAX + 1];
+	int i, len, freq = PCIMAXFM_FREQ_DEFAULT, power = PCIMAXFM_POWER_MAX;
+
+	len = pcimaxfm_pll_frame(buf, &freq, &power);
+	add_workload("freq/power", PCIMAXFM_I2C_ADDR_PLL, buf, len, 0);
+	add_workload("pll wave", PCIMAXFM_I2C_ADDR_PLL, buf, len, 1);
+
+	len = pcimaxfm_rds_frame(buf, "PWR", "1");
+	add_workload("pwr wave", PCIMAXFM_I2C_ADDR_RDS, buf, len, 1);
+
+	len = pcimaxfm_rds_frame(buf, rds_params_name[PS00], "PCIMAXFM");
+	add_workload("rds ps", PCIMAXFM_I2C_ADDR_RDS, buf, len, 0);
+
+	memset(value, 'x', PCIMAXFM_RDS_VALUE_MAX);
+	value[PCIMAXFM_RDS_VALUE_MAX] = '\0';
+	len = pcimaxfm_rds_frame(buf, rds_params_name[RT], value);
+	add_workload("rds rt", PCIMAXFM_I2C_ADDR_RDS, buf, len, 0);
+
+	/* Every parameter at its longest, as a full batch would. */
+	for (i = 0, len = 0; i < RDS_PARAM_END; i++) {
+		if (rds_params_type[i] == TEXT64)
+			value[PCIMAXFM_RDS_VALUE_MAX] = '\0';
+		else
+			value[8] = '\0';
+
+		len += pcimaxfm_rds_frame(buf + len, rds_params_name[i], value);
+		memset(value, 'x', PCIMAXFM_RDS_VALUE_MAX);
+	}
+	add_workload("rds batch", PCIMAXFM_I2C_ADDR_RDS, buf, len, 0);
+}
+
+static double cpu_nsecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Check the waveform of a single write decodes back to what was sent. */
+static void verify(struct sim *sim, const struct workload *w)
+{
+	struct sim_xfer xfer;
+	unsigned char data[BATCH_LEN];
+	char what[128];
+
+	xfer.data = data;
+
+	snprintf(what, sizeof(what), "%s decodes to one transaction", w->name);
+	check(sim_decode(sim, &xfer, 1, sizeof(data)) == 1, what);
+
+	snprintf(what, sizeof(what), "%s address and data", w->name);
+	check(xfer.addr == (w->addr | PCIMAXFM_I2C_ADDR_WRITE_FLAG) &&
+			!xfer.nack && xfer.len == w->len &&
+			!memcmp(xfer.data, w->buf, w->len), what);
+}
+
+static int transfer(struct pcimaxfm_i2c *bus, const struct workload *w)
+{
+	if (w->compiled)
+		return pcimaxfm_i2c_run(bus, &w->wave);
+
+	return pcimaxfm_i2c_write(bus, w->addr, w->buf, w->len);
+}
+
+static void bench(const struct profile *p, const struct workload *w,
+		int iterations)
+{
+	struct sim sim;
+	struct pcimaxfm_i2c bus = { .port = &sim, .timing = p->timing };
+	double start, nsecs;
+	int i;
+
+	sim_init(&sim);
+
+	sim.record = 1;
+	check(transfer(&bus, w) == PCIMAXFM_I2C_ACK, w->name);
+	verify(&sim, w);
+
+	printf("%-12s %-10s %6d %8lu %6lu %10llu",
+			p->name, w->name, w->len, sim.writes, sim.reads,
+			sim.usecs);
+
+	sim.record = 0;
+	start = cpu_nsecs();
+	for (i = 0; i < iterations; i++)
+		transfer(&bus, w);
+	nsecs = (cpu_nsecs() - start) / iterations;
+
+	printf(" %10.0f %8.1f\n", nsecs, nsecs / w->len);
+
+	sim_free(&sim);
+}
+
+/* Faults on the standard profile, with the default retries. */
+static void faults(void)
+{
+	const struct workload *w = &workloads[0];
+	struct sim sim;
+	struct pcimaxfm_i2c bus = {
+		.port = &sim,
+		.timing = profiles[1].timing,
+		.retries = PCIMAXFM_I2C_RETRIES
+	};
+	struct sim_xfer xfers[PCIMAXFM_I2C_RETRIES + 2];
+	unsigned char data[PCIMAXFM_I2C_RETRIES + 2][BATCH_LEN];
+	unsigned char batch[BATCH_LEN];
+	static const int names[] = { PS00, RT, PS00 };
+	static const char *const values[] = {
+		"PCIMAXFM", "Now playing on pcimaxfm", "ON AIR"
+	};
+	struct sim_rds rds;
+	int i, ret, count, len, start, acked, ends[3];
+
+	for (i = 0; i < PCIMAXFM_I2C_RETRIES + 2; i++)
+		xfers[i].data = data[i];
+
+	printf("\n%-28s %6s %8s %8s\n", "fault", "result", "attempts",
+			"usecs");
+
+	/* A single data NACK is retried from the start condition. */
+	sim_init(&sim);
+	sim.record = 1;
+	sim.nack_byte = 2;
+	sim.nack_count = 1;
+	ret = pcimaxfm_i2c_write(&bus, w->addr, w->buf, w->len);
+	count = sim_decode(&sim, xfers, PCIMAXFM_I2C_RETRIES + 2, BATCH_LEN);
+	printf("%-28s %6d %8u %8llu\n", "data nack once", ret, bus.attempts,
+			sim.usecs);
+	check(ret == PCIMAXFM_I2C_ACK && bus.attempts == 2 && count == 2 &&
+			xfers[0].nack && xfers[0].len == 2 &&
+			!xfers[1].nack && xfers[1].len == w->len,
+			"data nack once is retried");
+	sim_free(&sim);
+
+	/* The same from a compiled wave. */
+	sim_init(&sim);
+	sim.record = 1;
+	sim.nack_byte = 2;
+	sim.nack_count = 1;
+	ret = transfer(&bus, &workloads[1]);
+	count = sim_decode(&sim, xfers, PCIMAXFM_I2C_RETRIES + 2, BATCH_LEN);
+	printf("%-28s %6d %8u %8llu\n", "wave data nack once", ret,
+			bus.attempts, sim.usecs);
+	check(ret == PCIMAXFM_I2C_ACK && bus.attempts == 2 && count == 2 &&
+			xfers[0].nack && xfers[0].len == 2 &&
+			!xfers[1].nack && xfers[1].len == w->len &&
+			!memcmp(xfers[1].data, w->buf, w->len),
+			"wave data nack once is retried");
+	sim_free(&sim);
+
+	/* An absent target exhausts the retries. */
+	sim_init(&sim);
+	sim.record = 1;
+	sim.nack_byte = 0;
+	sim.nack_count = PCIMAXFM_I2C_RETRIES + 1;
+	ret = pcimaxfm_i2c_write(&bus, w->addr, w->buf, w->len);
+	count = sim_decode(&sim, xfers, PCIMAXFM_I2C_RETRIES + 2, BATCH_LEN);
+	printf("%-28s %6d %8u %8llu\n", "address nack", ret, bus.attempts,
+			sim.usecs);
+	check(ret == PCIMAXFM_I2C_NACK_ADDR &&
+			bus.attempts == PCIMAXFM_I2C_RETRIES + 1 &&
+			count == PCIMAXFM_I2C_RETRIES + 1 && xfers[0].nack,
+			"address nack gives up after the retries");
+	sim_free(&sim);
+
+	/* SDA held high reads as a NACK. */
+	sim_init(&sim);
+	sim.stuck_sda = 1;
+	ret = pcimaxfm_i2c_write(&bus, w->addr, w->buf, w->len);
+	printf("%-28s %6d %8u %8llu\n", "sda stuck high", ret, bus.attempts,
+			sim.usecs);
+	check(ret == PCIMAXFM_I2C_NACK_ADDR, "sda stuck high fails");
+	sim_free(&sim);
+
+	/* Without a clock no target answers. */
+	sim_init(&sim);
+	sim.stuck_scl = 0;
+	ret = pcimaxfm_i2c_write(&bus, w->addr, w->buf, w->len);
+	printf("%-28s %6d %8u %8llu\n", "scl stuck low", ret, bus.attempts,
+			sim.usecs);
+	check(ret == PCIMAXFM_I2C_NACK_ADDR, "scl stuck low fails");
+	sim_free(&sim);
+
+	/* SDA held low acknowledges everything but never shows a START, a
+	 * failure only the decoder catches. */
+	sim_init(&sim);
+	sim.record = 1;
+	sim.stuck_sda = 0;
+	ret = pcimaxfm_i2c_write(&bus, w->addr, w->buf, w->len);
+	count = sim_decode(&sim, xfers, PCIMAXFM_I2C_RETRIES + 2, BATCH_LEN);
+	printf("%-28s %6d %8u %8llu\n", "sda stuck low", ret, bus.attempts,
+			sim.usecs);
+	check(count == 0, "sda stuck low shows no transaction");
+	sim_free(&sim);
+
+	/* A yield ends the transaction after the byte in flight, with no
+	 * retry. */
+	sim_init(&sim);
+	sim.record = 1;
+	sim.yield_after = 3;
+	ret = pcimaxfm_i2c_write(&bus, w->addr, w->buf, w->len);
+	count = sim_decode(&sim, xfers, PCIMAXFM_I2C_RETRIES + 2, BATCH_LEN);
+	printf("%-28s %6d %8u %8llu\n", "yield", ret, bus.attempts,
+			sim.usecs);
+	check(ret == PCIMAXFM_I2C_YIELD && bus.attempts == 1 &&
+			bus.acked == 3 && count == 1 && !xfers[0].nack &&
+			xfers[0].len == 3 &&
+			!memcmp(xfers[0].data, w->buf, 3),
+			"yield stops after the byte in flight");
+	sim_free(&sim);
+
+	/* A batch cut mid frame and resent from the start of that frame, with
+	 * a tuning transaction in between, gets every frame to the encoder
+	 * once and never applies the cut one. */
+	sim_init(&sim);
+	sim.record = 1;
+	for (i = 0, len = 0; i < 3; i++) {
+		len += pcimaxfm_rds_frame(batch + len,
+				rds_params_name[names[i]], values[i]);
+		ends[i] = len;
+	}
+	sim.yield_after = ends[0] + 8;
+	ret = pcimaxfm_i2c_write(&bus, PCIMAXFM_I2C_ADDR_RDS, batch, len);
+	acked = bus.acked;
+	check(ret == PCIMAXFM_I2C_YIELD, "batch yields mid frame");
+	check(!pcimaxfm_i2c_recover(&bus), "recover after a cut frame");
+	check(pcimaxfm_i2c_write(&bus, w->addr, w->buf, w->len) ==
+			PCIMAXFM_I2C_ACK, "tuning between the halves");
+	for (i = 0, start = 0; i < 3 && ends[i] <= acked; i++)
+		start = ends[i];
+	ret = pcimaxfm_i2c_write(&bus, PCIMAXFM_I2C_ADDR_RDS, batch + start,
+			len - start);
+	count = sim_decode(&sim, xfers, PCIMAXFM_I2C_RETRIES + 2, BATCH_LEN);
+	sim_rds_init(&rds);
+	sim_rds_feed(&rds, xfers, count);
+	printf("%-28s %6d %8u %8llu\n", "rds frame cut", ret, bus.attempts,
+			sim.usecs);
+	check(ret == PCIMAXFM_I2C_ACK && count == 3 && rds.count == 3,
+			"rds frame cut applies every frame once");
+	for (i = 0; i < 3 && i < rds.count; i++)
+		check(!strcmp(rds.frames[i].param, rds_params_name[names[i]]) &&
+				!strcmp(rds.frames[i].value, values[i]),
+				"rds frame cut applies whole frames in order");
+	sim_free(&sim);
+
+	/* Recovery on a free bus takes a single clock and starts nothing. */
+	sim_init(&sim);
+	sim.record = 1;
+	ret = pcimaxfm_i2c_recover(&bus);
+	count = sim_decode(&sim, xfers, PCIMAXFM_I2C_RETRIES + 2, BATCH_LEN);
+	printf("%-28s %6d %8u %8llu\n", "recover", ret, 0, sim.usecs);
+	check(ret == 0 && count == 0 && bus.sda && bus.scl,
+			"recover leaves an idle bus");
+	sim_free(&sim);
+
+	/* A target that never lets go of SDA is reported. */
+	sim_init(&sim);
+	sim.stuck_sda = 0;
+	ret = pcimaxfm_i2c_recover(&bus);
+	printf("%-28s %6d %8u %8llu\n", "recover sda stuck low", ret, 0,
+			sim.usecs);
+	check(ret != 0, "recover reports sda stuck low");
+	sim_free(&sim);
+}
+
+static void print_help(char *prog_name)
+{
+	printf("Usage: %s [-n ITERATIONS]\n\n"
+			"Runs the I2C sequencer against a simulated card and "
+			"reports port accesses,\nbus time and CPU time per "
+			"transaction for each timing profile.\n", prog_name);
+	exit(-1);
+}
+
+int main(int argc, char **argv)
+{
+	int c, i, j, iterations = 1000;
+
+	while ((c = getopt(argc, argv, "n:h")) != -1) {
+		switch (c) {
+			case 'n':
+				if ((iterations = atoi(optarg)) < 1)
+					print_help(argv[0]);
+				break;
+			default:
+				print_help(argv[0]);
+		}
+	}
+
+	init_workloads();
+
+	printf("%-12s %-10s %6s %8s %6s %10s %10s %8s\n", "profile",
+			"workload", "bytes", "writes", "reads", "bus usecs",
+			"cpu nsecs", "ns/byte");
+
+	for (i = 0; i < (int)(sizeof(profiles) / sizeof(profiles[0])); i++) {
+		for (j = 0; j < workload_count; j++)
+			bench(&profiles[i], &workloads[j], iterations);
+	}
+
+	faults();
+
+	if (failures) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+
+	return 0;
+}
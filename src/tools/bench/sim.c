@@ -0,0 +1,278 @@
+/*
+ * pcimaxfm - PCI MAX FM transmitter driver and tools
+ * Copyright (C) 2007-2013 Daniel Stien <daniel@stien.org>
+ *  
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software 
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../common/i2c.h"
+#include "sim.h"
+
+/* Forget the waveform and counters, keeping the faults. The bus idles high
+ * through its pull-ups. */
+void sim_reset(struct sim *sim)
+{
+	sim->usecs = 0;
+	sim->writes = 0;
+	sim->reads = 0;
+	sim->len = 0;
+	sim->sda = 1;
+	sim->scl = 1;
+	sim->bit = 0;
+	sim->byte = 0;
+}
+
+void sim_init(struct sim *sim)
+{
+	memset(sim, 0, sizeof(*sim));
+
+	sim->nack_byte = SIM_FREE;
+	sim->stuck_sda = SIM_FREE;
+	sim->stuck_scl = SIM_FREE;
+	sim->yield_after = SIM_FREE;
+
+	sim_reset(sim);
+}
+
+void sim_free(struct sim *sim)
+{
+	free(sim->log);
+	sim->log = NULL;
+	sim->size = 0;
+	sim->len = 0;
+}
+
+static void sim_log(struct sim *sim, int read)
+{
+	struct sim_edge *edge;
+
+	if (!sim->record)
+		return;
+
+	if (sim->len == sim->size) {
+		sim->size = sim->size ? sim->size * 2 : 4096;
+		if ((sim->log = realloc(sim->log,
+						sim->size * sizeof(*edge))) == NULL)
+			abort();
+	}
+
+	edge = &sim->log[sim->len++];
+	edge->usecs = sim->usecs;
+	edge->sda = sim->sda;
+	edge->scl = sim->scl;
+	edge->read = read;
+}
+
+void pcimaxfm_i2c_port_set(void *port, int sda, int scl)
+{
+	struct sim *sim = port;
+
+	if (sim->stuck_sda != SIM_FREE)
+		sda = sim->stuck_sda;
+	if (sim->stuck_scl != SIM_FREE)
+		scl = sim->stuck_scl;
+
+	if (sim->scl && scl) {
+		if (sim->sda && !sda) {
+			/* START */
+			sim->bit = 0;
+			sim->byte = 0;
+		} else if (!sim->sda && sda) {
+			/* STOP */
+			sim->bit = 0;
+		}
+	} else if (!sim->scl && scl) {
+		if (sim->bit == 9) {
+			sim->bit = 0;
+			sim->byte++;
+		}
+		sim->bit++;
+	}
+
+	sim->sda = sda;
+	sim->scl = scl;
+	sim->writes++;
+
+	sim_log(sim, 0);
+}
+
+/* The ninth clock of a byte is the acknowledge, pulled low by the target
+ * unless a NACK is due. Anywhere else the released line reads high. */
+int pcimaxfm_i2c_port_get_sda(void *port)
+{
+	struct sim *sim = port;
+	int sda = 1;
+
+	sim->reads++;
+
+	if (sim->stuck_sda != SIM_FREE)
+		sda = sim->stuck_sda;
+	else if (sim->scl && sim->bit == 9) {
+		if (sim->byte == sim->nack_byte && sim->nack_count > 0)
+			sim->nack_count--;
+		else
+			sda = 0;
+	}
+
+	sim_log(sim, 1 + sda);
+
+	return sda;
+}
+
+void pcimaxfm_i2c_port_delay(void *port, unsigned int usecs)
+{
+	struct sim *sim = port;
+
+	sim->usecs += usecs;
+}
+
+/* The waveform is recorded at the port, events carry nothing more. */
+void pcimaxfm_i2c_port_event(void *port, int event, unsigned int value)
+{
+	(void)port;
+	(void)event;
+	(void)value;
+}
+
+int pcimaxfm_i2c_port_yield(void *port)
+{
+	struct sim *sim = port;
+
+	if (sim->yield_after == SIM_FREE || --sim->yield_after > 0)
+		return 0;
+
+	sim->yield_after = SIM_FREE;
+
+	return 1;
+}
+
+/* Rebuild the transactions from the recorded waveform, the way a logic
+ * analyser would: data is sampled on rising SCL, the acknowledge taken from
+ * the read during the ninth clock. Each transaction gets room for max_len bytes.
+ * Returns the number of transactions found. */
+int sim_decode(const struct sim *sim, struct sim_xfer *xfers, int max,
+		size_t max_len)
+{
+	const struct sim_edge *e;
+	struct sim_xfer *xfer = NULL;
+	int sda, scl, bit = 0, byte = 0, value = 0, count = 0;
+	size_t i;
+
+	sda = sim->stuck_sda != SIM_FREE ? sim->stuck_sda : 1;
+	scl = sim->stuck_scl != SIM_FREE ? sim->stuck_scl : 1;
+
+	for (i = 0; i < sim->len; i++) {
+		e = &sim->log[i];
+
+		if (e->read) {
+			if (xfer && bit == 9 && e->read == 2)
+				xfer->nack = 1;
+			continue;
+		}
+
+		if (scl && e->scl && sda && !e->sda) {
+			if (count == max)
+				break;
+
+			xfer = &xfers[count++];
+			xfer->start = e->usecs;
+			xfer->end = e->usecs;
+			xfer->addr = -1;
+			xfer->nack = 0;
+			xfer->len = 0;
+			bit = 0;
+			byte = 0;
+			value = 0;
+		} else if (xfer && scl && e->scl && !sda && e->sda) {
+			xfer->end = e->usecs;
+			xfer = NULL;
+		} else if (xfer && !scl && e->scl) {
+			if (bit == 9)
+				bit = 0;
+
+			if (++bit < 9) {
+				value = (value << 1) | e->sda;
+			} else {
+				if (byte++ == 0)
+					xfer->addr = value;
+				else if ((size_t)xfer->len < max_len)
+					xfer->data[xfer->len++] = value;
+
+				value = 0;
+			}
+		}
+
+		sda = e->sda;
+		scl = e->scl;
+	}
+
+	return count;
+}
+
+void sim_rds_init(struct sim_rds *rds)
+{
+	memset(rds, 0, sizeof(*rds));
+}
+
+static void sim_rds_byte(struct sim_rds *rds, unsigned char value)
+{
+	switch (value) {
+		case 0:
+			memset(&rds->cur, 0, sizeof(rds->cur));
+			rds->param_len = 0;
+			rds->value_len = 0;
+			rds->state = SIM_RDS_PARAM;
+			break;
+		case 1:
+			rds->state = rds->state == SIM_RDS_PARAM ?
+				SIM_RDS_VALUE : SIM_RDS_IDLE;
+			break;
+		case 2:
+			if (rds->state == SIM_RDS_VALUE &&
+					rds->count < SIM_RDS_FRAMES)
+				rds->frames[rds->count++] = rds->cur;
+			rds->state = SIM_RDS_IDLE;
+			break;
+		default:
+			if (rds->state == SIM_RDS_PARAM &&
+					rds->param_len < (int)sizeof(rds->cur.param) - 1)
+				rds->cur.param[rds->param_len++] = value;
+			else if (rds->state == SIM_RDS_VALUE &&
+					rds->value_len < PCIMAXFM_RDS_VALUE_MAX)
+				rds->cur.value[rds->value_len++] = value;
+			else
+				rds->state = SIM_RDS_IDLE;
+			break;
+	}
+}
+
+/* Feed the encoder the data of the decoded transactions addressed to it. */
+void sim_rds_feed(struct sim_rds *rds, const struct sim_xfer *xfers,
+		int count)
+{
+	int i, j;
+
+	for (i = 0; i < count; i++) {
+		if (xfers[i].addr != (PCIMAXFM_I2C_ADDR_RDS |
+					PCIMAXFM_I2C_ADDR_WRITE_FLAG))
+			continue;
+
+		for (j = 0; j < xfers[i].len; j++)
+			sim_rds_byte(rds, xfers[i].data[j]);
+	}
+}
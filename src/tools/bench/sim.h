@@ -0,0 +1,113 @@
+/*
+ * pcimaxfm - PCI MAX FM transmitter driver and tools
+ * Copyright (C) 2007-2013 Daniel Stien <daniel@stien.org>
+ *  
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software 
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _PCIMAXFM_BENCH_SIM_H
+#define _PCIMAXFM_BENCH_SIM_H
+
+#include <stddef.h>
+
+#include <pcimaxfm.h>
+
+#define SIM_FREE	-1
+
+/* Line levels after a port access, or the level sampled by a read. */
+struct sim_edge {
+	unsigned long long usecs;
+	unsigned char sda;
+	unsigned char scl;
+	unsigned char read;
+};
+
+/* Simulated card, passed as the port of the I2C sequencer. Time is virtual:
+ * delays advance it without sleeping. */
+struct sim {
+	unsigned long long usecs;
+	unsigned long writes;
+	unsigned long reads;
+
+	/* Waveform, kept while record is set. */
+	int record;
+	struct sim_edge *log;
+	size_t len;
+	size_t size;
+
+	/* Faults: NACK byte nack_byte of a transaction (0 being the address)
+	 * nack_count times, hold a line at a level unless SIM_FREE. */
+	int nack_byte;
+	int nack_count;
+	int stuck_sda;
+	int stuck_scl;
+
+	/* Ask for the bus back once yield_after data bytes went through,
+	 * unless SIM_FREE. */
+	int yield_after;
+
+	/* Target side view of the bus. */
+	int sda;
+	int scl;
+	int bit;
+	int byte;
+};
+
+/* Transaction seen on the wire. */
+struct sim_xfer {
+	unsigned long long start;
+	unsigned long long end;
+	int addr;
+	int nack;
+	int len;
+	unsigned char *data;
+};
+
+/* RDS encoder frame parser, as the driver assumes it to work: 0 opens a
+ * frame and drops any partial one, 1 ends the parameter name and 2 applies
+ * the frame. Anything else outside a frame is ignored. The state outlives
+ * transactions, so a frame cut by a STOP is only dropped by the next 0. */
+#define SIM_RDS_FRAMES	16
+
+enum {
+	SIM_RDS_IDLE, SIM_RDS_PARAM, SIM_RDS_VALUE
+};
+
+struct sim_rds_frame {
+	char param[8];
+	char value[PCIMAXFM_RDS_VALUE_MAX + 1];
+};
+
+struct sim_rds {
+	int state;
+	int param_len;
+	int value_len;
+	struct sim_rds_frame cur;
+
+	/* Frames applied, in order. */
+	int count;
+	struct sim_rds_frame frames[SIM_RDS_FRAMES];
+};
+
+void sim_init(struct sim *);
+void sim_reset(struct sim *);
+void sim_free(struct sim *);
+
+int sim_decode(const struct sim *, struct sim_xfer *, int, size_t);
+
+void sim_rds_init(struct sim_rds *);
+void sim_rds_feed(struct sim_rds *, const struct sim_xfer *, int);
+
+#endif /* _PCIMAXFM_BENCH_SIM_H */
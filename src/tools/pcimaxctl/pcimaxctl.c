@@ -41,7 +41,10 @@
 
 int verbosity = 0;
 int fd = 0;
+int fd_flags = O_RDONLY;
 char *dev = "/dev/pcimaxfm0";
+int bcast_count = 0;
+int bcast_devs[PCIMAXFM_BROADCAST_MAX];
 
 static struct option long_options[] = {
 #if PCIMAXFM_ENABLE_TX_TOGGLE
@@ -56,7 +59,11 @@ static struct option long_options[] = {
 #endif /* PCIMAXFM_ENABLE_RDS_TOGGLE */
 	{ "rds",        required_argument, 0, 'r' },
 #endif /* PCIMAXFM_ENABLE_RDS */
+	{ "ping",       no_argument,       0, 'i' },
+	{ "status",     no_argument,       0, 'S' },
+	{ "dump",       optional_argument, 0, 'D' },
 	{ "device",     optional_argument, 0, 'd' },
+	{ "broadcast",  required_argument, 0, 'b' },
 	{ "verbose",    no_argument,       0, 'v' },
 	{ "quiet",      no_argument,       0, 'q' },
 	{ "version",    no_argument,       0, 'e' },
@@ -95,10 +102,17 @@ void print_help(char *prog, int status)
 #if PCIMAXFM_ENABLE_RDS_TOGGLE
 	printf("-g, --rds-signal[=1|0]    get/toggle RDS signal (1 = on, 0 = off)\n");
 #endif /* PCIMAXFM_ENABLE_RDS_TOGGLE */
-	printf("-r, --rds=PARM=VAL[,...]  set RDS parameters (see --help-rds)\n\n");
+	printf("-r, --rds=PARM[=VAL][,...]\n");
+	printf("                          get/set RDS parameters (see --help-rds)\n\n");
 #endif /* PCIMAXFM_ENABLE_RDS */
 
+	printf("-i, --ping                check that the I2C targets respond\n");
+	printf("-S, --status              print all settings at once\n");
+	printf("-D, --dump[=FORMAT]       print what reading the device gives, as text,\n");
+	printf("                          keyval or json (default: text)\n");
 	printf("-d, --device[=FILE]       pcimaxfm device (default: /dev/pcimaxfm0)\n");
+	printf("-b, --broadcast=N[,...]   apply following settings to the given device\n");
+	printf("                          numbers at once\n");
 	printf("-v, --verbose             verbose output\n");
 	printf("-q, --quiet               no output\n");
 	printf("-e, --version             print version and exit\n");
@@ -144,13 +158,22 @@ void print_help_rds(int status)
 }
 #endif /* PCIMAXFM_ENABLE_RDS */
 
-void dev_open()
+/* Queries open the device read-only, which any number of processes may do.
+ * Settings need a writable open, which is exclusive. */
+void dev_open(int flags)
 {
+	if (fd && flags == O_RDWR && fd_flags != O_RDWR) {
+		close(fd);
+		fd = 0;
+	}
+
 	if (!fd) {
-		if((fd = open(dev, O_RDWR)) == -1) {
+		if((fd = open(dev, flags)) == -1) {
 			perror("open");
 			exit(-1);
 		}
+
+		fd_flags = flags;
 	}
 }
 
@@ -160,18 +183,56 @@ void dev_close()
 		close(fd);
 }
 
+/* Apply a setting to the device, or to all broadcast devices. */
+int dev_set(unsigned int cmd, void *arg)
+{
+	int i, ret;
+	static struct pcimaxfm_broadcast2 bc;
+
+	dev_open(O_RDWR);
+
+	if (!bcast_count)
+		return ioctl(fd, cmd, arg);
+
+	memset(&bc, 0, sizeof(bc));
+
+	bc.cmd   = cmd;
+	bc.count = bcast_count;
+	memcpy(bc.devs, bcast_devs, bcast_count * sizeof(bc.devs[0]));
+
+#if PCIMAXFM_ENABLE_RDS
+	if (cmd == PCIMAXFM_RDS_SET_BATCH2)
+		memcpy(&bc.rds, arg, sizeof(bc.rds));
+	else
+#endif /* PCIMAXFM_ENABLE_RDS */
+		bc.data = *(int *)arg;
+
+	ret = ioctl(fd, PCIMAXFM_BROADCAST2, &bc);
+
+	for (i = 0; i < bcast_count; i++) {
+		if (bc.status[i]) {
+			NOTICE_MSG("Device %d: %s", bcast_devs[i],
+					strerror(-bc.status[i]));
+		} else {
+			DEBUG_MSG("Device %d: OK", bcast_devs[i]);
+		}
+	}
+
+	return ret;
+}
+
 #if PCIMAXFM_ENABLE_TX_TOGGLE
 void tx(char *arg)
 {
 	int tx;
 
-	dev_open();
+	dev_open(O_RDONLY);
 	if (arg) {
 		if (sscanf(arg, "%u", &tx) < 1 || tx < 0 || tx > 1) {
 			ERROR_MSG("Invalid transmitter power state. Got \"%s\", expected integer 1 or 0.", arg);
 		}
 
-		if (ioctl(fd, PCIMAXFM_TX_SET, &tx) == -1) {
+		if (dev_set(PCIMAXFM_TX_SET, &tx) == -1) {
 			ERROR_MSG("Setting transmitter power state failed.");
 		}
 	} else {
@@ -189,7 +250,7 @@ void freq(const char *arg)
 	int freq;
 	double ffreq;
 
-	dev_open();
+	dev_open(O_RDONLY);
 	if (arg) {
 		if (sscanf(arg, "%lf", &ffreq) < 1) {
 			ERROR_MSG("Invalid frequency. Got \"%s\", expected floating point number in the range of %.2f-%.2f or integer in the range of %d-%d.",
@@ -211,7 +272,7 @@ void freq(const char *arg)
 					PCIMAXFM_FREQ_MIN, PCIMAXFM_FREQ_MAX);
 		}
 		
-		if (ioctl(fd, PCIMAXFM_FREQ_SET, &freq) == -1) {
+		if (dev_set(PCIMAXFM_FREQ_SET, &freq) == -1) {
 			ERROR_MSG("Setting frequency failed.");
 		}
 	} else {
@@ -232,7 +293,7 @@ void power(const char *arg)
 {
 	int power;
 
-	dev_open();
+	dev_open(O_RDONLY);
 	if (arg) {
 		if (sscanf(arg, "%u", &power) < 1) {
 			ERROR_MSG("Invalid power level. Got \"%s\", expected integer in the range of %d-%d.", arg, PCIMAXFM_POWER_MIN, PCIMAXFM_POWER_MAX);
@@ -242,7 +303,7 @@ void power(const char *arg)
 			ERROR_MSG("Power level out of range. Got %d, expected %d-%d.", power, PCIMAXFM_POWER_MIN, PCIMAXFM_POWER_MAX);
 		}
 
-		if (ioctl(fd, PCIMAXFM_POWER_SET, &power) == -1) {
+		if (dev_set(PCIMAXFM_POWER_SET, &power) == -1) {
 			ERROR_MSG("Setting power level failed.");
 		}
 	} else {
@@ -263,13 +324,13 @@ void stereo(char *arg)
 {
 	int stereo;
 
-	dev_open();
+	dev_open(O_RDONLY);
 	if (arg) {
 		if (sscanf(arg, "%u", &stereo) < 1 || stereo < 0 || stereo > 1) {
 			ERROR_MSG("Invalid stereo encoder state. Got \"%s\", expected integer 1 or 0.", arg);
 		}
 
-		if (ioctl(fd, PCIMAXFM_STEREO_SET, &stereo) == -1) {
+		if (dev_set(PCIMAXFM_STEREO_SET, &stereo) == -1) {
 			ERROR_MSG("Setting stereo encoder state failed.");
 		}
 	} else {
@@ -287,13 +348,13 @@ void rds_signal(char *arg)
 {
 	int signal;
 
-	dev_open();
+	dev_open(O_RDONLY);
 	if (arg) {
 		if (sscanf(arg, "%u", &signal) < 1 || signal < 0 || signal > 1) {
 			ERROR_MSG("Invalid RDS signal state. Got \"%s\", expected integer 1 or 0.", arg);
 		}
 
-		if (ioctl(fd, PCIMAXFM_RDSSIGNAL_SET, &signal) == -1) {
+		if (dev_set(PCIMAXFM_RDSSIGNAL_SET, &signal) == -1) {
 			ERROR_MSG("Setting RDS signal state failed.");
 		}
 	} else {
@@ -306,37 +367,222 @@ void rds_signal(char *arg)
 }
 #endif /* PCIMAXFM_ENABLE_RDS_TOGGLE */
 
+void rds_get(int param)
+{
+	struct pcimaxfm_rds_get rds_get;
+
+	dev_open(O_RDONLY);
+
+	rds_get.param = param;
+
+	if (ioctl(fd, PCIMAXFM_RDS_GET, &rds_get) == -1) {
+		ERROR_MSG("Reading RDS parameter %s failed.",
+				rds_params_name[param]);
+	}
+
+	if (rds_get.value[0] == '\0') {
+		NOTICE_MSG("RDS: %-4s not set yet.", rds_params_name[param]);
+	} else {
+		NOTICE_MSG("RDS: %-4s = \"%s\"%s", rds_params_name[param],
+				rds_get.value,
+				rds_get.dirty ? " (not confirmed)" : "");
+	}
+}
+
 void rds(char *arg)
 {
-	int c;
+	int c, i, count = 0;
 	char *val, err[0xff];
-	struct pcimaxfm_rds_set rds_set;
+	static struct pcimaxfm_rds_batch2 batch;
+	struct pcimaxfm_rds_set2 *set;
 
 	while (*arg != '\0') {
 		if ((c = (getsubopt(&arg, rds_params_name, &val))) == -1)
 			ERROR_MSG("Invalid RDS parameter \"%s\".", val);
 
+		if (val == NULL) {
+			rds_get(c);
+			continue;
+		}
+
 		if (validate_rds(c, val, sizeof(err), err)) {
 			ERROR_MSG("%s", err);
 		}
 
-		dev_open();
+		if (count == PCIMAXFM_RDS_BATCH_MAX) {
+			ERROR_MSG("Too many RDS parameters, expected at most %d.",
+					PCIMAXFM_RDS_BATCH_MAX);
+		}
+
+		set = &batch.sets[count++];
+		set->param = c;
+		set->len = strlen(val);
+		memcpy(set->value, val, set->len);
+	}
+
+	if (count == 0)
+		return;
 
-		rds_set.param = c;
-		rds_set.value = val;
+	if (count == 1 && !bcast_count) {
+		set = &batch.sets[0];
 
-		if(ioctl(fd, PCIMAXFM_RDS_SET, &rds_set) == -1) {
-			ERROR_MSG("Writing RDS parameter %s = \"%s\" failed.",
-					rds_params_name[rds_set.param],
-					rds_set.value);
+		dev_open(O_RDWR);
+
+		if(ioctl(fd, PCIMAXFM_RDS_SET2, set) == -1) {
+			ERROR_MSG("Writing RDS parameter %s = \"%.*s\" failed.",
+					rds_params_name[set->param],
+					set->len, set->value);
 		}
+	} else {
+		batch.count = count;
 
-		NOTICE_MSG("RDS: %-4s = \"%s\"",
-				rds_params_name[rds_set.param], rds_set.value);
+		if(dev_set(PCIMAXFM_RDS_SET_BATCH2, &batch) == -1) {
+			ERROR_MSG("Writing %d RDS parameters failed.", count);
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		set = &batch.sets[i];
+
+		NOTICE_MSG("RDS: %-4s = \"%.*s\"", rds_params_name[set->param],
+				set->len, set->value);
 	}
 }
 #endif /* PCIMAXFM_ENABLE_RDS */
 
+void ping_target(const char *name, int addr)
+{
+	if (ioctl(fd, PCIMAXFM_PING, &addr) == -1) {
+		ERROR_MSG("No response from %s (I2C address %#x).", name, addr);
+	}
+
+	NOTICE_MSG("%s: OK", name);
+}
+
+void ping()
+{
+	dev_open(O_RDWR);
+
+	ping_target("PLL", PCIMAXFM_I2C_ADDR_PLL);
+#if PCIMAXFM_ENABLE_RDS
+	ping_target("RDS encoder", PCIMAXFM_I2C_ADDR_RDS);
+#endif /* PCIMAXFM_ENABLE_RDS */
+}
+
+void broadcast(char *arg)
+{
+	char *end;
+
+	bcast_count = 0;
+
+	while (*arg != '\0') {
+		if (bcast_count == PCIMAXFM_BROADCAST_MAX) {
+			ERROR_MSG("Too many devices, expected at most %d.",
+					PCIMAXFM_BROADCAST_MAX);
+		}
+
+		bcast_devs[bcast_count] = strtol(arg, &end, 10);
+
+		if (end == arg || (*end != ',' && *end != '\0') ||
+				bcast_devs[bcast_count] < 0) {
+			ERROR_MSG("Invalid device number list \"%s\".", arg);
+		}
+
+		bcast_count++;
+		arg = (*end == ',') ? end + 1 : end;
+	}
+
+	DEBUG_MSG("Broadcasting to %d devices.", bcast_count);
+}
+
+void status()
+{
+	struct pcimaxfm_status st;
+#if PCIMAXFM_ENABLE_RDS
+	int i;
+#endif /* PCIMAXFM_ENABLE_RDS */
+
+	dev_open(O_RDONLY);
+
+	st.version = PCIMAXFM_STATUS_VERSION;
+
+	if (ioctl(fd, PCIMAXFM_STATUS_GET, &st) == -1) {
+		ERROR_MSG("Reading status failed.");
+	}
+
+	if (st.flags & PCIMAXFM_STATUS_TX) {
+		NOTICE_MSG("Transmitter: %s", PCIMAXFM_STR_BOOL(st.tx));
+	}
+
+	if (st.freq == PCIMAXFM_FREQ_NA) {
+		NOTICE_MSG("Frequency not set yet.");
+	} else {
+		NOTICE_MSG("Frequency: %.2f MHz (%d 50 KHz steps)", FREQ(st.freq), st.freq);
+	}
+
+	if (st.power == PCIMAXFM_POWER_NA) {
+		NOTICE_MSG("Power level not set yet.");
+	} else {
+		NOTICE_MSG("Power level: %d/%d", st.power, PCIMAXFM_POWER_MAX);
+	}
+
+	NOTICE_MSG("Stereo encoder: %s", PCIMAXFM_STR_BOOL(st.stereo));
+
+	if (st.flags & PCIMAXFM_STATUS_RDSSIGNAL) {
+		NOTICE_MSG("RDS signal: %s", PCIMAXFM_STR_BOOL(st.rdssignal));
+	}
+
+	NOTICE_MSG("Queued requests: %d", st.queue_depth);
+
+#if PCIMAXFM_ENABLE_RDS
+	for (i = 0; i < RDS_PARAM_END; i++) {
+		if (st.rds[i][0] == '\0')
+			continue;
+
+		NOTICE_MSG("RDS: %-4s = \"%s\"%s", rds_params_name[i],
+				st.rds[i],
+				(st.rds_dirty[i / 32] & (1u << (i % 32))) ?
+				" (not confirmed)" : "");
+	}
+#endif /* PCIMAXFM_ENABLE_RDS */
+}
+
+void dump(char *arg)
+{
+	int format = PCIMAXFM_FORMAT_TEXT;
+	char buf[0x100];
+	ssize_t len;
+
+	if (arg == NULL || strcmp(arg, "text") == 0) {
+		format = PCIMAXFM_FORMAT_TEXT;
+	} else if (strcmp(arg, "keyval") == 0) {
+		format = PCIMAXFM_FORMAT_KEYVAL;
+	} else if (strcmp(arg, "json") == 0) {
+		format = PCIMAXFM_FORMAT_JSON;
+	} else {
+		ERROR_MSG("Invalid dump format \"%s\".", arg);
+	}
+
+	dev_open(O_RDONLY);
+
+	if (ioctl(fd, PCIMAXFM_FORMAT_SET, &format) == -1) {
+		ERROR_MSG("Setting dump format failed.");
+	}
+
+	if (lseek(fd, 0, SEEK_SET) == -1) {
+		ERROR_MSG("Rewinding device failed.");
+	}
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		if (verbosity >= 0)
+			fwrite(buf, 1, len, stdout);
+	}
+
+	if (len == -1) {
+		ERROR_MSG("Reading device failed.");
+	}
+}
+
 void device(char *arg)
 {
 	if (arg) {
@@ -372,7 +618,7 @@ int main(int argc, char **argv)
 #endif /* PCIMAXFM_ENABLE_RDS_TOGGLE */
 				"r:"
 #endif /* PCIMAXFM_ENABLE_RDS */
-				"d::vqehH",
+				"iSD::d::b:vqehH",
 				long_options, &option_index);
 
 		if (c == -1)
@@ -403,9 +649,21 @@ int main(int argc, char **argv)
 				rds(optarg);
 				break;
 #endif /* PCIMAXFM_ENABLE_RDS */
+			case 'i':
+				ping();
+				break;
+			case 'S':
+				status();
+				break;
+			case 'D':
+				dump(optarg);
+				break;
 			case 'd':
 				device(optarg);
 				break;
+			case 'b':
+				broadcast(optarg);
+				break;
 			case 'v':
 				verbosity = 1;
 				DEBUG_MSG("Verbose output.");